@@ -45,6 +45,170 @@ static inline int string_shape(const char* string, FontSettings font_info,
   }
   return p_ts_string_shape(string, font_info, size, res, loc, id, cluster, font, fallbacks, fallback_scaling);
 }
+
+// Reentrant API ---------------------------------------------------------------
+// The functions above use a shaper shared with the rest of textshaping and must
+// only be called on the main R thread. A ShaperContext owns its own shaper so
+// the functions below can be called from any thread, as long as each context is
+// only used by one thread at a time. Font fallback and emoji lookups go through
+// systemfonts, which may only be called on the main thread. Off the main thread
+// these lookups are queued and the calling thread waits until the main thread
+// runs them with context_serve(), e.g. while it waits for a device to render.
+// Text that may need fallback fonts or contain emoji (any character from
+// U+200D) should therefore only be shaped off the main thread while the main
+// thread serves these requests. Create the first context on the main thread as
+// that also looks up the other functions. Errors are returned as non-zero
+// codes and never raised as R errors
+struct ShaperContext;
+
+namespace detail {
+struct ContextApi {
+  ShaperContext* (*create)();
+  void (*destroy)(ShaperContext*);
+  int (*serve)();
+  int (*string_width)(ShaperContext*, const char*, FontSettings, double, double, int, double*);
+  int (*string_shape)(ShaperContext*, const char*, FontSettings, double, double, std::vector<Point>&, std::vector<uint32_t>&, std::vector<int>&, std::vector<unsigned int>&, std::vector<FontSettings>&, std::vector<double>&);
+};
+static inline ContextApi& context_api() {
+  static ContextApi api = {NULL, NULL, NULL, NULL, NULL};
+  if (api.create == NULL) {
+    api.destroy = (void (*)(ShaperContext*)) R_GetCCallable("textshaping", "ts_context_destroy");
+    api.serve = (int (*)()) R_GetCCallable("textshaping", "ts_context_serve");
+    api.string_width = (int (*)(ShaperContext*, const char*, FontSettings, double, double, int, double*)) R_GetCCallable("textshaping", "ts_context_string_width");
+    api.string_shape = (int (*)(ShaperContext*, const char*, FontSettings, double, double, std::vector<Point>&, std::vector<uint32_t>&, std::vector<int>&, std::vector<unsigned int>&, std::vector<FontSettings>&, std::vector<double>&)) R_GetCCallable("textshaping", "ts_context_string_shape");
+    api.create = (ShaperContext* (*)()) R_GetCCallable("textshaping", "ts_context_create");
+  }
+  return api;
+}
+}
+
+// Create a new shaper context. Returns NULL on failure
+static inline ShaperContext* context_create() {
+  return detail::context_api().create();
+}
+
+// Destroy a context created with context_create()
+static inline void context_destroy(ShaperContext* context) {
+  detail::context_api().destroy(context);
+}
+
+// Run the systemfonts lookups queued by contexts used on other threads. Must be
+// called on the main thread and returns a non-zero code otherwise
+static inline int context_serve() {
+  return detail::context_api().serve();
+}
+
+// As string_width() but using the given context
+static inline int context_string_width(ShaperContext* context, const char* string,
+                                       FontSettings font_info, double size, double res,
+                                       int include_bearing, double* width) {
+  return detail::context_api().string_width(context, string, font_info, size, res, include_bearing, width);
+}
+
+// As string_shape() but using the given context
+static inline int context_string_shape(ShaperContext* context, const char* string,
+                                       FontSettings font_info, double size, double res,
+                                       std::vector<Point>& loc, std::vector<uint32_t>& id,
+                                       std::vector<int>& cluster, std::vector<unsigned int>& font,
+                                       std::vector<FontSettings>& fallbacks,
+                                       std::vector<double>& fallback_scaling) {
+  return detail::context_api().string_shape(context, string, font_info, size, res, loc, id, cluster, font, fallbacks, fallback_scaling);
+}
+
+// Batched API -----------------------------------------------------------------
+// Measure or shape n strings in one call. Strings are processed grouped by font
+// so devices drawing many labels avoid switching fonts for every string. With
+// a NULL context the shared shaper is used and the main thread rule above
+// applies. Processing stops at the first error and its code is returned
+
+// Calculate the width of each string, writing them to the n-length widths array
+static inline int string_widths(const char** strings, const FontSettings* font_info,
+                                const double* size, const double* res,
+                                int include_bearing, int n, double* widths,
+                                ShaperContext* context = NULL) {
+  static int (*p_ts_string_widths)(ShaperContext*, const char**, const FontSettings*, const double*, const double*, int, int, double*) = NULL;
+  if (p_ts_string_widths == NULL) {
+    p_ts_string_widths = (int (*)(ShaperContext*, const char**, const FontSettings*, const double*, const double*, int, int, double*)) R_GetCCallable("textshaping", "ts_string_widths");
+  }
+  return p_ts_string_widths(context, strings, font_info, size, res, include_bearing, n, widths);
+}
+
+// Shape each string. The glyphs of string i are found in
+// [glyph_offset[i], glyph_offset[i + 1]) of loc, id, cluster, and font, and
+// its fallbacks in [fallback_offset[i], fallback_offset[i + 1]) of fallbacks
+// and fallback_scaling. Font indices are relative to the fallbacks of the
+// string
+static inline int string_shapes(const char** strings, const FontSettings* font_info,
+                                const double* size, const double* res, int n,
+                                std::vector<int>& glyph_offset, std::vector<Point>& loc,
+                                std::vector<uint32_t>& id, std::vector<int>& cluster,
+                                std::vector<unsigned int>& font, std::vector<int>& fallback_offset,
+                                std::vector<FontSettings>& fallbacks,
+                                std::vector<double>& fallback_scaling,
+                                ShaperContext* context = NULL) {
+  static int (*p_ts_string_shapes)(ShaperContext*, const char**, const FontSettings*, const double*, const double*, int, std::vector<int>&, std::vector<Point>&, std::vector<uint32_t>&, std::vector<int>&, std::vector<unsigned int>&, std::vector<int>&, std::vector<FontSettings>&, std::vector<double>&) = NULL;
+  if (p_ts_string_shapes == NULL) {
+    p_ts_string_shapes = (int (*)(ShaperContext*, const char**, const FontSettings*, const double*, const double*, int, std::vector<int>&, std::vector<Point>&, std::vector<uint32_t>&, std::vector<int>&, std::vector<unsigned int>&, std::vector<int>&, std::vector<FontSettings>&, std::vector<double>&)) R_GetCCallable("textshaping", "ts_string_shapes");
+  }
+  return p_ts_string_shapes(context, strings, font_info, size, res, n, glyph_offset, loc, id, cluster, font, fallback_offset, fallbacks, fallback_scaling);
+}
+
+// Allocation free API ---------------------------------------------------------
+// Shape a string without allocating memory on the caller side. The context
+// rules are as for the batched API
+
+// Write the shaped glyphs into caller owned arrays of length capacity, and the
+// fonts they refer to into arrays of length fallback_capacity. n_glyphs and
+// n_fallbacks are set to the number of glyphs and fonts in the result. If
+// either is larger than the capacity only the part that fits is written and
+// the call should be repeated with larger buffers
+static inline int string_shape_buffer(const char* string, FontSettings font_info,
+                                      double size, double res, unsigned int capacity,
+                                      Point* loc, uint32_t* id, unsigned int* font,
+                                      unsigned int* n_glyphs, unsigned int fallback_capacity,
+                                      FontSettings* fallbacks, double* fallback_scaling,
+                                      unsigned int* n_fallbacks, ShaperContext* context = NULL) {
+  static int (*p_ts_string_shape_buffer)(ShaperContext*, const char*, FontSettings, double, double, unsigned int, Point*, uint32_t*, unsigned int*, unsigned int*, unsigned int, FontSettings*, double*, unsigned int*) = NULL;
+  if (p_ts_string_shape_buffer == NULL) {
+    p_ts_string_shape_buffer = (int (*)(ShaperContext*, const char*, FontSettings, double, double, unsigned int, Point*, uint32_t*, unsigned int*, unsigned int*, unsigned int, FontSettings*, double*, unsigned int*)) R_GetCCallable("textshaping", "ts_string_shape_buffer");
+  }
+  return p_ts_string_shape_buffer(context, string, font_info, size, res, capacity, loc, id, font, n_glyphs, fallback_capacity, fallbacks, fallback_scaling, n_fallbacks);
+}
+
+// Called for every run of glyphs using the same font, in visual order. The
+// arrays are only valid during the call. The visitor must not throw or raise R
+// errors
+typedef void (*GlyphRunVisitor)(const uint32_t* id, const Point* loc,
+                                unsigned int n_glyphs, const FontSettings* font,
+                                double scaling, void* data);
+
+// Shape a string and pass the glyph runs to visitor along with data
+static inline int string_shape_visit(const char* string, FontSettings font_info,
+                                     double size, double res, GlyphRunVisitor visitor,
+                                     void* data, ShaperContext* context = NULL) {
+  static int (*p_ts_string_shape_visit)(ShaperContext*, const char*, FontSettings, double, double, GlyphRunVisitor, void*) = NULL;
+  if (p_ts_string_shape_visit == NULL) {
+    p_ts_string_shape_visit = (int (*)(ShaperContext*, const char*, FontSettings, double, double, GlyphRunVisitor, void*)) R_GetCCallable("textshaping", "ts_string_shape_visit");
+  }
+  return p_ts_string_shape_visit(context, string, font_info, size, res, visitor, data);
+}
+
+// Character metrics -----------------------------------------------------------
+// Get the ascent, descent, and advance width of a single character, e.g. for
+// answering metricInfo requests in a graphics device. Results are cached per
+// font, size, and character. Characters missing from the font are measured
+// with the fallback font shaping would use. The context rules are as for the
+// batched API
+static inline int glyph_metrics(uint32_t codepoint, FontSettings font_info,
+                                double size, double res, double* ascent,
+                                double* descent, double* width,
+                                ShaperContext* context = NULL) {
+  static int (*p_ts_glyph_metrics)(ShaperContext*, uint32_t, FontSettings, double, double, double*, double*, double*) = NULL;
+  if (p_ts_glyph_metrics == NULL) {
+    p_ts_glyph_metrics = (int (*)(ShaperContext*, uint32_t, FontSettings, double, double, double*, double*, double*)) R_GetCCallable("textshaping", "ts_glyph_metrics");
+  }
+  return p_ts_glyph_metrics(context, codepoint, font_info, size, res, ascent, descent, width);
+}
 }
 
 
@@ -0,0 +1,252 @@
+#include "arrow_export.h"
+
+#include <cstring>
+#include <stdexcept>
+
+#define R_NO_REMAP
+#include <cpp11/R.hpp>
+
+struct ArrowColumn {
+  std::string name;
+  std::string format;
+  int64_t flags;
+  int64_t length;
+  int64_t null_count;
+  std::vector<uint8_t> validity;
+  std::vector<int32_t> ints;
+  std::vector<double> doubles;
+  std::vector<int32_t> offsets;
+  std::string chars;
+  std::vector<uint8_t> bits;
+  std::vector<const void*> buffers;
+
+  ArrowColumn(const char* _name, const char* _format, int64_t _length) :
+    name(_name),
+    format(_format),
+    flags(0),
+    length(_length),
+    null_count(0) {}
+};
+
+namespace {
+
+// Private data of exported schemas. Leaf and struct schemas share the layout,
+// leaves just don't have children
+struct SchemaData {
+  std::string format;
+  std::string name;
+  std::vector<ArrowSchema> children;
+  std::vector<ArrowSchema*> child_ptrs;
+};
+
+// Private data of exported arrays. A leaf array owns its column (and thus its
+// buffers) while a struct array owns the child structs
+struct ArrayData {
+  std::unique_ptr<ArrowColumn> column;
+  std::vector<const void*> buffers;
+  std::vector<ArrowArray> children;
+  std::vector<ArrowArray*> child_ptrs;
+};
+
+void release_schema(ArrowSchema* schema) {
+  if (schema == nullptr || schema->release == nullptr) return;
+  for (int64_t i = 0; i < schema->n_children; ++i) {
+    ArrowSchema* child = schema->children[i];
+    if (child->release != nullptr) child->release(child);
+  }
+  delete static_cast<SchemaData*>(schema->private_data);
+  schema->release = nullptr;
+}
+
+void release_array(ArrowArray* array) {
+  if (array == nullptr || array->release == nullptr) return;
+  for (int64_t i = 0; i < array->n_children; ++i) {
+    ArrowArray* child = array->children[i];
+    if (child->release != nullptr) child->release(child);
+  }
+  delete static_cast<ArrayData*>(array->private_data);
+  array->release = nullptr;
+}
+
+void init_schema(ArrowSchema* schema, SchemaData* data, int64_t flags) {
+  schema->format = data->format.c_str();
+  schema->name = data->name.c_str();
+  schema->metadata = nullptr;
+  schema->flags = flags;
+  schema->n_children = data->child_ptrs.size();
+  schema->children = data->child_ptrs.empty() ? nullptr : data->child_ptrs.data();
+  schema->dictionary = nullptr;
+  schema->release = &release_schema;
+  schema->private_data = data;
+}
+
+void init_array(ArrowArray* array, ArrayData* data, int64_t length, int64_t null_count) {
+  array->length = length;
+  array->null_count = null_count;
+  array->offset = 0;
+  array->n_buffers = data->buffers.size();
+  array->buffers = data->buffers.data();
+  array->n_children = data->child_ptrs.size();
+  array->children = data->child_ptrs.empty() ? nullptr : data->child_ptrs.data();
+  array->dictionary = nullptr;
+  array->release = &release_array;
+  array->private_data = data;
+}
+
+// Buffers may only be null if they have zero size, so make sure empty vectors
+// still point to valid memory
+template<typename T>
+inline const void* buffer_pointer(std::vector<T>& buffer) {
+  if (buffer.capacity() == 0) buffer.reserve(1);
+  return buffer.data();
+}
+
+inline void set_bit(std::vector<uint8_t>& bitmap, size_t i) {
+  bitmap[i / 8] |= uint8_t(1) << (i % 8);
+}
+
+}
+
+ArrowTable::ArrowTable() : length(-1), columns() {}
+ArrowTable::~ArrowTable() {}
+
+void ArrowTable::check_length(size_t n) {
+  if (length < 0) {
+    length = n;
+  } else if (int64_t(n) != length) {
+    throw std::length_error("All columns in an Arrow table must have the same length");
+  }
+}
+
+void ArrowTable::add_column(const char* name, std::vector<int32_t>&& data, int32_t null_value) {
+  add_column(name, std::move(data));
+  ArrowColumn& column = *columns.back();
+  column.flags = ARROW_FLAG_NULLABLE;
+  std::vector<uint8_t> validity((column.length + 7) / 8, 0);
+  for (int64_t i = 0; i < column.length; ++i) {
+    if (column.ints[i] == null_value) {
+      column.null_count++;
+    } else {
+      set_bit(validity, i);
+    }
+  }
+  if (column.null_count != 0) {
+    column.validity.swap(validity);
+    column.buffers[0] = column.validity.data();
+  }
+}
+
+void ArrowTable::add_column(const char* name, std::vector<int32_t>&& data) {
+  check_length(data.size());
+  columns.emplace_back(new ArrowColumn(name, "i", data.size()));
+  ArrowColumn& column = *columns.back();
+  column.ints.swap(data);
+  column.buffers = {nullptr, buffer_pointer(column.ints)};
+}
+
+void ArrowTable::add_column(const char* name, std::vector<double>&& data) {
+  check_length(data.size());
+  columns.emplace_back(new ArrowColumn(name, "g", data.size()));
+  ArrowColumn& column = *columns.back();
+  column.doubles.swap(data);
+  column.buffers = {nullptr, buffer_pointer(column.doubles)};
+}
+
+void ArrowTable::add_column(const char* name, const std::vector<std::string>& data) {
+  check_length(data.size());
+  columns.emplace_back(new ArrowColumn(name, "u", data.size()));
+  ArrowColumn& column = *columns.back();
+  column.offsets.reserve(data.size() + 1);
+  column.offsets.push_back(0);
+  for (auto iter = data.begin(); iter != data.end(); ++iter) {
+    column.chars.append(*iter);
+    if (column.chars.size() > INT32_MAX) {
+      throw std::length_error("String data too large for an Arrow utf8 array");
+    }
+    column.offsets.push_back(column.chars.size());
+  }
+  column.buffers = {nullptr, buffer_pointer(column.offsets), column.chars.c_str()};
+}
+
+void ArrowTable::add_column(const char* name, const std::vector<bool>& data) {
+  check_length(data.size());
+  columns.emplace_back(new ArrowColumn(name, "b", data.size()));
+  ArrowColumn& column = *columns.back();
+  column.bits.assign((data.size() + 7) / 8, 0);
+  for (size_t i = 0; i < data.size(); ++i) {
+    if (data[i]) set_bit(column.bits, i);
+  }
+  column.buffers = {nullptr, buffer_pointer(column.bits)};
+}
+
+void ArrowTable::export_to(ArrowSchema* schema, ArrowArray* array) {
+  size_t n_columns = columns.size();
+  if (length < 0) length = 0;
+
+  SchemaData* table_schema = new SchemaData();
+  table_schema->format = "+s";
+  table_schema->children.resize(n_columns);
+
+  ArrayData* table_array = new ArrayData();
+  table_array->buffers = {nullptr};
+  table_array->children.resize(n_columns);
+
+  for (size_t i = 0; i < n_columns; ++i) {
+    std::unique_ptr<ArrowColumn>& column = columns[i];
+
+    SchemaData* column_schema = new SchemaData();
+    column_schema->format = column->format;
+    column_schema->name = column->name;
+    init_schema(&table_schema->children[i], column_schema, column->flags);
+    table_schema->child_ptrs.push_back(&table_schema->children[i]);
+
+    ArrayData* column_array = new ArrayData();
+    column_array->buffers = column->buffers;
+    int64_t column_length = column->length;
+    int64_t null_count = column->null_count;
+    column_array->column = std::move(column);
+    init_array(&table_array->children[i], column_array, column_length, null_count);
+    table_array->child_ptrs.push_back(&table_array->children[i]);
+  }
+
+  init_schema(schema, table_schema, 0);
+  init_array(array, table_array, length, 0);
+
+  columns.clear();
+  length = -1;
+}
+
+static void finalize_schema_xptr(SEXP xptr) {
+  ArrowSchema* schema = static_cast<ArrowSchema*>(R_ExternalPtrAddr(xptr));
+  if (schema == nullptr) return;
+  if (schema->release != nullptr) schema->release(schema);
+  delete schema;
+  R_ClearExternalPtr(xptr);
+}
+
+static void finalize_array_xptr(SEXP xptr) {
+  ArrowArray* array = static_cast<ArrowArray*>(R_ExternalPtrAddr(xptr));
+  if (array == nullptr) return;
+  if (array->release != nullptr) array->release(array);
+  delete array;
+  R_ClearExternalPtr(xptr);
+}
+
+cpp11::sexp arrow_table_to_sexp(ArrowSchema* schema, ArrowArray* array) {
+  // Move the structs to the heap so their lifetime is managed by R
+  ArrowSchema* schema_ptr = new ArrowSchema(*schema);
+  schema->release = nullptr;
+  ArrowArray* array_ptr = new ArrowArray(*array);
+  array->release = nullptr;
+
+  cpp11::sexp schema_xptr = R_MakeExternalPtr(schema_ptr, R_NilValue, R_NilValue);
+  R_RegisterCFinalizerEx(schema_xptr, finalize_schema_xptr, TRUE);
+  schema_xptr.attr("class") = "nanoarrow_schema";
+
+  cpp11::sexp array_xptr = R_MakeExternalPtr(array_ptr, schema_xptr, R_NilValue);
+  R_RegisterCFinalizerEx(array_xptr, finalize_array_xptr, TRUE);
+  array_xptr.attr("class") = "nanoarrow_array";
+  array_xptr.attr("schema") = schema_xptr;
+
+  return array_xptr;
+}
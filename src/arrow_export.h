@@ -0,0 +1,86 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <cpp11/sexp.hpp>
+
+// Arrow C Data Interface
+// https://arrow.apache.org/docs/format/CDataInterface.html
+// The definitions below are copied verbatim from the specification, and are
+// guarded so they can coexist with other copies
+
+#ifndef ARROW_C_DATA_INTERFACE
+#define ARROW_C_DATA_INTERFACE
+
+#define ARROW_FLAG_DICTIONARY_ORDERED 1
+#define ARROW_FLAG_NULLABLE 2
+#define ARROW_FLAG_MAP_KEYS_SORTED 4
+
+struct ArrowSchema {
+  // Array type description
+  const char* format;
+  const char* name;
+  const char* metadata;
+  int64_t flags;
+  int64_t n_children;
+  struct ArrowSchema** children;
+  struct ArrowSchema* dictionary;
+
+  // Release callback
+  void (*release)(struct ArrowSchema*);
+  // Opaque producer-specific data
+  void* private_data;
+};
+
+struct ArrowArray {
+  // Array data description
+  int64_t length;
+  int64_t null_count;
+  int64_t offset;
+  int64_t n_buffers;
+  int64_t n_children;
+  const void** buffers;
+  struct ArrowArray** children;
+  struct ArrowArray* dictionary;
+
+  // Release callback
+  void (*release)(struct ArrowArray*);
+  // Opaque producer-specific data
+  void* private_data;
+};
+
+#endif  // ARROW_C_DATA_INTERFACE
+
+struct ArrowColumn;
+
+// Collects a set of equal-length columns and exports them as a single struct
+// array. The column data is moved into the exported arrays which then own it
+// until the consumer calls the release callback
+class ArrowTable {
+public:
+  ArrowTable();
+  ~ArrowTable();
+
+  void add_column(const char* name, std::vector<int32_t>&& data, int32_t null_value);
+  void add_column(const char* name, std::vector<int32_t>&& data);
+  void add_column(const char* name, std::vector<double>&& data);
+  void add_column(const char* name, const std::vector<std::string>& data);
+  void add_column(const char* name, const std::vector<bool>& data);
+
+  // Fill in the (caller allocated) schema and array structs. The table is empty
+  // afterwards
+  void export_to(ArrowSchema* schema, ArrowArray* array);
+
+private:
+  int64_t length;
+  std::vector<std::unique_ptr<ArrowColumn>> columns;
+
+  void check_length(size_t n);
+};
+
+// Wrap an exported schema and array in external pointers following the
+// conventions of the nanoarrow package, taking ownership of both
+cpp11::sexp arrow_table_to_sexp(ArrowSchema* schema, ArrowArray* array);
@@ -1,8 +1,12 @@
 #pragma once
 
+#include <algorithm>
 #include <unordered_map>
 #include <list>
 #include <functional>
+#include <memory>
+#include <mutex>
+#include <vector>
 
 template<typename key_t, typename value_t>
 class LRU_Cache {
@@ -91,3 +95,116 @@ protected:
   list_t _cache_list;
   map_t _cache_map;
 };
+
+// A cache that can be shared between threads. Keys are spread over a number of
+// shards, each with its own lock, so threads only contend when they hit the
+// same shard. Within a shard the least recently used entry is approximated with
+// the clock algorithm: lookups only set a reference bit so they don't have to
+// reorder anything, and eviction sweeps over the entries clearing the bits
+// until it finds one that hasn't been used since the last sweep
+template<typename key_t, typename value_t>
+class Concurrent_Cache {
+
+public:
+  Concurrent_Cache() :
+  Concurrent_Cache(32) {
+
+  }
+  Concurrent_Cache(size_t max_size, unsigned int shard_bits = 4) :
+  _shard_bits(shard_bits),
+  _shards(new Shard[size_t(1) << shard_bits]) {
+    size_t n_shards = size_t(1) << shard_bits;
+    size_t shard_size = std::max((max_size + n_shards - 1) / n_shards, size_t(1));
+    for (size_t i = 0; i < n_shards; ++i) {
+      _shards[i].max_size = shard_size;
+    }
+  }
+
+  // Add a key-value pair, replacing the value if the key already exists.
+  // Returns true if another entry was evicted to make room and false otherwise
+  inline bool add(const key_t& key, const value_t& value) {
+    Shard& shard = shard_for(key);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    slot_map_it_t it = shard.slot_map.find(key);
+    if (it != shard.slot_map.end()) {
+      shard.slots[it->second].value = value;
+      shard.slots[it->second].referenced = true;
+      return false;
+    }
+    if (shard.slots.size() < shard.max_size) {
+      shard.slot_map[key] = shard.slots.size();
+      shard.slots.push_back({key, value, false});
+      return false;
+    }
+    while (shard.slots[shard.hand].referenced) {
+      shard.slots[shard.hand].referenced = false;
+      shard.hand = (shard.hand + 1) % shard.slots.size();
+    }
+    Entry& victim = shard.slots[shard.hand];
+    shard.slot_map.erase(victim.key);
+    shard.slot_map[key] = shard.hand;
+    victim.key = key;
+    victim.value = value;
+    shard.hand = (shard.hand + 1) % shard.slots.size();
+    return true;
+  }
+
+  // Retrieve a value based on a key, returning true if a value was found
+  inline bool get(const key_t& key, value_t& value) {
+    Shard& shard = shard_for(key);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    slot_map_it_t it = shard.slot_map.find(key);
+    if (it == shard.slot_map.end()) {
+      return false;
+    }
+    value = shard.slots[it->second].value;
+    shard.slots[it->second].referenced = true;
+    return true;
+  }
+
+  // Check for the existence of a key-value pair
+  inline bool exist(const key_t& key) {
+    Shard& shard = shard_for(key);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    return shard.slot_map.find(key) != shard.slot_map.end();
+  }
+
+  // Clear the cache
+  inline void clear() {
+    size_t n_shards = size_t(1) << _shard_bits;
+    for (size_t i = 0; i < n_shards; ++i) {
+      std::lock_guard<std::mutex> lock(_shards[i].mutex);
+      _shards[i].slots.clear();
+      _shards[i].slot_map.clear();
+      _shards[i].hand = 0;
+    }
+  }
+
+private:
+  struct Entry {
+    key_t key;
+    value_t value;
+    bool referenced;
+  };
+  typedef typename std::unordered_map<key_t, size_t> slot_map_t;
+  typedef typename slot_map_t::iterator slot_map_it_t;
+
+  struct Shard {
+    std::mutex mutex;
+    std::vector<Entry> slots;
+    slot_map_t slot_map;
+    size_t hand = 0;
+    size_t max_size = 1;
+  };
+
+  unsigned int _shard_bits;
+  std::unique_ptr<Shard[]> _shards;
+
+  // Key hashes are often simple xor combinations so they are mixed before
+  // picking a shard
+  inline Shard& shard_for(const key_t& key) {
+    if (_shard_bits == 0) return _shards[0];
+    size_t hash = std::hash<key_t>()(key) * size_t(0x9E3779B97F4A7C15ULL);
+    return _shards[hash >> (sizeof(size_t) * 8 - _shard_bits)];
+  }
+};
@@ -13,17 +13,80 @@ extern "C" SEXP _textshaping_get_face_features_c(SEXP path, SEXP index) {
   END_CPP11
 }
 // string_metrics.h
-list get_string_shape_c(strings string, integers id, strings path, integers index, list_of<list> features, doubles size, doubles res, doubles lineheight, integers align, doubles hjust, doubles vjust, doubles width, doubles tracking, doubles indent, doubles hanging, doubles space_before, doubles space_after, integers direction, list_of<integers> soft_wrap, list_of<integers> hard_wrap);
-extern "C" SEXP _textshaping_get_string_shape_c(SEXP string, SEXP id, SEXP path, SEXP index, SEXP features, SEXP size, SEXP res, SEXP lineheight, SEXP align, SEXP hjust, SEXP vjust, SEXP width, SEXP tracking, SEXP indent, SEXP hanging, SEXP space_before, SEXP space_after, SEXP direction, SEXP soft_wrap, SEXP hard_wrap) {
+list get_string_shape_c(strings string, integers id, strings path, integers index, list_of<list> features, doubles size, doubles res, doubles lineheight, integers align, doubles hjust, doubles vjust, doubles width, doubles tracking, doubles indent, doubles hanging, doubles space_before, doubles space_after, integers direction, bool metrics_only, int threads);
+extern "C" SEXP _textshaping_get_string_shape_c(SEXP string, SEXP id, SEXP path, SEXP index, SEXP features, SEXP size, SEXP res, SEXP lineheight, SEXP align, SEXP hjust, SEXP vjust, SEXP width, SEXP tracking, SEXP indent, SEXP hanging, SEXP space_before, SEXP space_after, SEXP direction, SEXP metrics_only, SEXP threads) {
   BEGIN_CPP11
-    return cpp11::as_sexp(get_string_shape_c(cpp11::as_cpp<cpp11::decay_t<strings>>(string), cpp11::as_cpp<cpp11::decay_t<integers>>(id), cpp11::as_cpp<cpp11::decay_t<strings>>(path), cpp11::as_cpp<cpp11::decay_t<integers>>(index), cpp11::as_cpp<cpp11::decay_t<list_of<list>>>(features), cpp11::as_cpp<cpp11::decay_t<doubles>>(size), cpp11::as_cpp<cpp11::decay_t<doubles>>(res), cpp11::as_cpp<cpp11::decay_t<doubles>>(lineheight), cpp11::as_cpp<cpp11::decay_t<integers>>(align), cpp11::as_cpp<cpp11::decay_t<doubles>>(hjust), cpp11::as_cpp<cpp11::decay_t<doubles>>(vjust), cpp11::as_cpp<cpp11::decay_t<doubles>>(width), cpp11::as_cpp<cpp11::decay_t<doubles>>(tracking), cpp11::as_cpp<cpp11::decay_t<doubles>>(indent), cpp11::as_cpp<cpp11::decay_t<doubles>>(hanging), cpp11::as_cpp<cpp11::decay_t<doubles>>(space_before), cpp11::as_cpp<cpp11::decay_t<doubles>>(space_after), cpp11::as_cpp<cpp11::decay_t<integers>>(direction), cpp11::as_cpp<cpp11::decay_t<list_of<integers>>>(soft_wrap), cpp11::as_cpp<cpp11::decay_t<list_of<integers>>>(hard_wrap)));
+    return cpp11::as_sexp(get_string_shape_c(cpp11::as_cpp<cpp11::decay_t<strings>>(string), cpp11::as_cpp<cpp11::decay_t<integers>>(id), cpp11::as_cpp<cpp11::decay_t<strings>>(path), cpp11::as_cpp<cpp11::decay_t<integers>>(index), cpp11::as_cpp<cpp11::decay_t<list_of<list>>>(features), cpp11::as_cpp<cpp11::decay_t<doubles>>(size), cpp11::as_cpp<cpp11::decay_t<doubles>>(res), cpp11::as_cpp<cpp11::decay_t<doubles>>(lineheight), cpp11::as_cpp<cpp11::decay_t<integers>>(align), cpp11::as_cpp<cpp11::decay_t<doubles>>(hjust), cpp11::as_cpp<cpp11::decay_t<doubles>>(vjust), cpp11::as_cpp<cpp11::decay_t<doubles>>(width), cpp11::as_cpp<cpp11::decay_t<doubles>>(tracking), cpp11::as_cpp<cpp11::decay_t<doubles>>(indent), cpp11::as_cpp<cpp11::decay_t<doubles>>(hanging), cpp11::as_cpp<cpp11::decay_t<doubles>>(space_before), cpp11::as_cpp<cpp11::decay_t<doubles>>(space_after), cpp11::as_cpp<cpp11::decay_t<integers>>(direction), cpp11::as_cpp<cpp11::decay_t<bool>>(metrics_only), cpp11::as_cpp<cpp11::decay_t<int>>(threads)));
   END_CPP11
 }
 // string_metrics.h
-doubles get_line_width_c(strings string, strings path, integers index, doubles size, doubles res, logicals include_bearing, list_of<list> features);
-extern "C" SEXP _textshaping_get_line_width_c(SEXP string, SEXP path, SEXP index, SEXP size, SEXP res, SEXP include_bearing, SEXP features) {
+list get_string_shape_arrow_c(strings string, integers id, strings path, integers index, list_of<list> features, doubles size, doubles res, doubles lineheight, integers align, doubles hjust, doubles vjust, doubles width, doubles tracking, doubles indent, doubles hanging, doubles space_before, doubles space_after, integers direction, integers order, int threads);
+extern "C" SEXP _textshaping_get_string_shape_arrow_c(SEXP string, SEXP id, SEXP path, SEXP index, SEXP features, SEXP size, SEXP res, SEXP lineheight, SEXP align, SEXP hjust, SEXP vjust, SEXP width, SEXP tracking, SEXP indent, SEXP hanging, SEXP space_before, SEXP space_after, SEXP direction, SEXP order, SEXP threads) {
   BEGIN_CPP11
-    return cpp11::as_sexp(get_line_width_c(cpp11::as_cpp<cpp11::decay_t<strings>>(string), cpp11::as_cpp<cpp11::decay_t<strings>>(path), cpp11::as_cpp<cpp11::decay_t<integers>>(index), cpp11::as_cpp<cpp11::decay_t<doubles>>(size), cpp11::as_cpp<cpp11::decay_t<doubles>>(res), cpp11::as_cpp<cpp11::decay_t<logicals>>(include_bearing), cpp11::as_cpp<cpp11::decay_t<list_of<list>>>(features)));
+    return cpp11::as_sexp(get_string_shape_arrow_c(cpp11::as_cpp<cpp11::decay_t<strings>>(string), cpp11::as_cpp<cpp11::decay_t<integers>>(id), cpp11::as_cpp<cpp11::decay_t<strings>>(path), cpp11::as_cpp<cpp11::decay_t<integers>>(index), cpp11::as_cpp<cpp11::decay_t<list_of<list>>>(features), cpp11::as_cpp<cpp11::decay_t<doubles>>(size), cpp11::as_cpp<cpp11::decay_t<doubles>>(res), cpp11::as_cpp<cpp11::decay_t<doubles>>(lineheight), cpp11::as_cpp<cpp11::decay_t<integers>>(align), cpp11::as_cpp<cpp11::decay_t<doubles>>(hjust), cpp11::as_cpp<cpp11::decay_t<doubles>>(vjust), cpp11::as_cpp<cpp11::decay_t<doubles>>(width), cpp11::as_cpp<cpp11::decay_t<doubles>>(tracking), cpp11::as_cpp<cpp11::decay_t<doubles>>(indent), cpp11::as_cpp<cpp11::decay_t<doubles>>(hanging), cpp11::as_cpp<cpp11::decay_t<doubles>>(space_before), cpp11::as_cpp<cpp11::decay_t<doubles>>(space_after), cpp11::as_cpp<cpp11::decay_t<integers>>(direction), cpp11::as_cpp<cpp11::decay_t<integers>>(order), cpp11::as_cpp<cpp11::decay_t<int>>(threads)));
+  END_CPP11
+}
+// string_metrics.h
+doubles get_shape_timings_c();
+extern "C" SEXP _textshaping_get_shape_timings_c() {
+  BEGIN_CPP11
+    return cpp11::as_sexp(get_shape_timings_c());
+  END_CPP11
+}
+// string_metrics.h
+sexp shape_text_async_c(strings string, integers id, strings path, integers index, list_of<list> features, doubles size, doubles res, doubles lineheight, integers align, doubles hjust, doubles vjust, doubles width, doubles tracking, doubles indent, doubles hanging, doubles space_before, doubles space_after, integers direction, bool metrics_only, int threads);
+extern "C" SEXP _textshaping_shape_text_async_c(SEXP string, SEXP id, SEXP path, SEXP index, SEXP features, SEXP size, SEXP res, SEXP lineheight, SEXP align, SEXP hjust, SEXP vjust, SEXP width, SEXP tracking, SEXP indent, SEXP hanging, SEXP space_before, SEXP space_after, SEXP direction, SEXP metrics_only, SEXP threads) {
+  BEGIN_CPP11
+    return cpp11::as_sexp(shape_text_async_c(cpp11::as_cpp<cpp11::decay_t<strings>>(string), cpp11::as_cpp<cpp11::decay_t<integers>>(id), cpp11::as_cpp<cpp11::decay_t<strings>>(path), cpp11::as_cpp<cpp11::decay_t<integers>>(index), cpp11::as_cpp<cpp11::decay_t<list_of<list>>>(features), cpp11::as_cpp<cpp11::decay_t<doubles>>(size), cpp11::as_cpp<cpp11::decay_t<doubles>>(res), cpp11::as_cpp<cpp11::decay_t<doubles>>(lineheight), cpp11::as_cpp<cpp11::decay_t<integers>>(align), cpp11::as_cpp<cpp11::decay_t<doubles>>(hjust), cpp11::as_cpp<cpp11::decay_t<doubles>>(vjust), cpp11::as_cpp<cpp11::decay_t<doubles>>(width), cpp11::as_cpp<cpp11::decay_t<doubles>>(tracking), cpp11::as_cpp<cpp11::decay_t<doubles>>(indent), cpp11::as_cpp<cpp11::decay_t<doubles>>(hanging), cpp11::as_cpp<cpp11::decay_t<doubles>>(space_before), cpp11::as_cpp<cpp11::decay_t<doubles>>(space_after), cpp11::as_cpp<cpp11::decay_t<integers>>(direction), cpp11::as_cpp<cpp11::decay_t<bool>>(metrics_only), cpp11::as_cpp<cpp11::decay_t<int>>(threads)));
+  END_CPP11
+}
+// string_metrics.h
+bool shape_job_done_c(sexp job);
+extern "C" SEXP _textshaping_shape_job_done_c(SEXP job) {
+  BEGIN_CPP11
+    return cpp11::as_sexp(shape_job_done_c(cpp11::as_cpp<cpp11::decay_t<sexp>>(job)));
+  END_CPP11
+}
+// string_metrics.h
+list shape_job_collect_c(sexp job);
+extern "C" SEXP _textshaping_shape_job_collect_c(SEXP job) {
+  BEGIN_CPP11
+    return cpp11::as_sexp(shape_job_collect_c(cpp11::as_cpp<cpp11::decay_t<sexp>>(job)));
+  END_CPP11
+}
+// string_metrics.h
+sexp shape_text_prepare_c(strings string, integers id, strings path, integers index, list_of<list> features, doubles size, doubles res, doubles lineheight, integers align, doubles hjust, doubles vjust, doubles width, doubles tracking, doubles indent, doubles hanging, doubles space_before, doubles space_after, integers direction, int threads);
+extern "C" SEXP _textshaping_shape_text_prepare_c(SEXP string, SEXP id, SEXP path, SEXP index, SEXP features, SEXP size, SEXP res, SEXP lineheight, SEXP align, SEXP hjust, SEXP vjust, SEXP width, SEXP tracking, SEXP indent, SEXP hanging, SEXP space_before, SEXP space_after, SEXP direction, SEXP threads) {
+  BEGIN_CPP11
+    return cpp11::as_sexp(shape_text_prepare_c(cpp11::as_cpp<cpp11::decay_t<strings>>(string), cpp11::as_cpp<cpp11::decay_t<integers>>(id), cpp11::as_cpp<cpp11::decay_t<strings>>(path), cpp11::as_cpp<cpp11::decay_t<integers>>(index), cpp11::as_cpp<cpp11::decay_t<list_of<list>>>(features), cpp11::as_cpp<cpp11::decay_t<doubles>>(size), cpp11::as_cpp<cpp11::decay_t<doubles>>(res), cpp11::as_cpp<cpp11::decay_t<doubles>>(lineheight), cpp11::as_cpp<cpp11::decay_t<integers>>(align), cpp11::as_cpp<cpp11::decay_t<doubles>>(hjust), cpp11::as_cpp<cpp11::decay_t<doubles>>(vjust), cpp11::as_cpp<cpp11::decay_t<doubles>>(width), cpp11::as_cpp<cpp11::decay_t<doubles>>(tracking), cpp11::as_cpp<cpp11::decay_t<doubles>>(indent), cpp11::as_cpp<cpp11::decay_t<doubles>>(hanging), cpp11::as_cpp<cpp11::decay_t<doubles>>(space_before), cpp11::as_cpp<cpp11::decay_t<doubles>>(space_after), cpp11::as_cpp<cpp11::decay_t<integers>>(direction), cpp11::as_cpp<cpp11::decay_t<int>>(threads)));
+  END_CPP11
+}
+// string_metrics.h
+list shape_text_layout_c(sexp text, doubles lineheight, integers align, doubles hjust, doubles vjust, doubles width, doubles indent, doubles hanging, doubles space_before, doubles space_after, list_of<doubles> line_width, list_of<doubles> line_offset, bool metrics_only);
+extern "C" SEXP _textshaping_shape_text_layout_c(SEXP text, SEXP lineheight, SEXP align, SEXP hjust, SEXP vjust, SEXP width, SEXP indent, SEXP hanging, SEXP space_before, SEXP space_after, SEXP line_width, SEXP line_offset, SEXP metrics_only) {
+  BEGIN_CPP11
+    return cpp11::as_sexp(shape_text_layout_c(cpp11::as_cpp<cpp11::decay_t<sexp>>(text), cpp11::as_cpp<cpp11::decay_t<doubles>>(lineheight), cpp11::as_cpp<cpp11::decay_t<integers>>(align), cpp11::as_cpp<cpp11::decay_t<doubles>>(hjust), cpp11::as_cpp<cpp11::decay_t<doubles>>(vjust), cpp11::as_cpp<cpp11::decay_t<doubles>>(width), cpp11::as_cpp<cpp11::decay_t<doubles>>(indent), cpp11::as_cpp<cpp11::decay_t<doubles>>(hanging), cpp11::as_cpp<cpp11::decay_t<doubles>>(space_before), cpp11::as_cpp<cpp11::decay_t<doubles>>(space_after), cpp11::as_cpp<cpp11::decay_t<list_of<doubles>>>(line_width), cpp11::as_cpp<cpp11::decay_t<list_of<doubles>>>(line_offset), cpp11::as_cpp<cpp11::decay_t<bool>>(metrics_only)));
+  END_CPP11
+}
+// string_metrics.h
+doubles shape_text_wrap_width_c(sexp text, integers n_lines, doubles width, doubles indent, doubles hanging);
+extern "C" SEXP _textshaping_shape_text_wrap_width_c(SEXP text, SEXP n_lines, SEXP width, SEXP indent, SEXP hanging) {
+  BEGIN_CPP11
+    return cpp11::as_sexp(shape_text_wrap_width_c(cpp11::as_cpp<cpp11::decay_t<sexp>>(text), cpp11::as_cpp<cpp11::decay_t<integers>>(n_lines), cpp11::as_cpp<cpp11::decay_t<doubles>>(width), cpp11::as_cpp<cpp11::decay_t<doubles>>(indent), cpp11::as_cpp<cpp11::decay_t<doubles>>(hanging)));
+  END_CPP11
+}
+// string_metrics.h
+doubles fit_text_size_c(strings string, integers id, strings path, integers index, list_of<list> features, doubles size, doubles res, doubles lineheight, integers align, doubles hjust, doubles vjust, doubles width, doubles tracking, doubles indent, doubles hanging, doubles space_before, doubles space_after, integers direction, doubles height, doubles min_scale, doubles max_scale, int threads);
+extern "C" SEXP _textshaping_fit_text_size_c(SEXP string, SEXP id, SEXP path, SEXP index, SEXP features, SEXP size, SEXP res, SEXP lineheight, SEXP align, SEXP hjust, SEXP vjust, SEXP width, SEXP tracking, SEXP indent, SEXP hanging, SEXP space_before, SEXP space_after, SEXP direction, SEXP height, SEXP min_scale, SEXP max_scale, SEXP threads) {
+  BEGIN_CPP11
+    return cpp11::as_sexp(fit_text_size_c(cpp11::as_cpp<cpp11::decay_t<strings>>(string), cpp11::as_cpp<cpp11::decay_t<integers>>(id), cpp11::as_cpp<cpp11::decay_t<strings>>(path), cpp11::as_cpp<cpp11::decay_t<integers>>(index), cpp11::as_cpp<cpp11::decay_t<list_of<list>>>(features), cpp11::as_cpp<cpp11::decay_t<doubles>>(size), cpp11::as_cpp<cpp11::decay_t<doubles>>(res), cpp11::as_cpp<cpp11::decay_t<doubles>>(lineheight), cpp11::as_cpp<cpp11::decay_t<integers>>(align), cpp11::as_cpp<cpp11::decay_t<doubles>>(hjust), cpp11::as_cpp<cpp11::decay_t<doubles>>(vjust), cpp11::as_cpp<cpp11::decay_t<doubles>>(width), cpp11::as_cpp<cpp11::decay_t<doubles>>(tracking), cpp11::as_cpp<cpp11::decay_t<doubles>>(indent), cpp11::as_cpp<cpp11::decay_t<doubles>>(hanging), cpp11::as_cpp<cpp11::decay_t<doubles>>(space_before), cpp11::as_cpp<cpp11::decay_t<doubles>>(space_after), cpp11::as_cpp<cpp11::decay_t<integers>>(direction), cpp11::as_cpp<cpp11::decay_t<doubles>>(height), cpp11::as_cpp<cpp11::decay_t<doubles>>(min_scale), cpp11::as_cpp<cpp11::decay_t<doubles>>(max_scale), cpp11::as_cpp<cpp11::decay_t<int>>(threads)));
+  END_CPP11
+}
+// string_metrics.h
+doubles get_line_width_c(strings string, strings path, integers index, doubles size, doubles res, logicals include_bearing, list_of<list> features, int threads);
+extern "C" SEXP _textshaping_get_line_width_c(SEXP string, SEXP path, SEXP index, SEXP size, SEXP res, SEXP include_bearing, SEXP features, SEXP threads) {
+  BEGIN_CPP11
+    return cpp11::as_sexp(get_line_width_c(cpp11::as_cpp<cpp11::decay_t<strings>>(string), cpp11::as_cpp<cpp11::decay_t<strings>>(path), cpp11::as_cpp<cpp11::decay_t<integers>>(index), cpp11::as_cpp<cpp11::decay_t<doubles>>(size), cpp11::as_cpp<cpp11::decay_t<doubles>>(res), cpp11::as_cpp<cpp11::decay_t<logicals>>(include_bearing), cpp11::as_cpp<cpp11::decay_t<list_of<list>>>(features), cpp11::as_cpp<cpp11::decay_t<int>>(threads)));
   END_CPP11
 }
 // string_metrics.h
@@ -36,10 +99,19 @@ extern "C" SEXP _textshaping_get_systemfont_cache_compat() {
 
 extern "C" {
 static const R_CallMethodDef CallEntries[] = {
+    {"_textshaping_fit_text_size_c",             (DL_FUNC) &_textshaping_fit_text_size_c,             22},
     {"_textshaping_get_face_features_c",         (DL_FUNC) &_textshaping_get_face_features_c,          2},
-    {"_textshaping_get_line_width_c",            (DL_FUNC) &_textshaping_get_line_width_c,             7},
+    {"_textshaping_get_line_width_c",            (DL_FUNC) &_textshaping_get_line_width_c,             8},
+    {"_textshaping_get_shape_timings_c",         (DL_FUNC) &_textshaping_get_shape_timings_c,          0},
+    {"_textshaping_get_string_shape_arrow_c",    (DL_FUNC) &_textshaping_get_string_shape_arrow_c,    20},
     {"_textshaping_get_string_shape_c",          (DL_FUNC) &_textshaping_get_string_shape_c,          20},
     {"_textshaping_get_systemfont_cache_compat", (DL_FUNC) &_textshaping_get_systemfont_cache_compat,  0},
+    {"_textshaping_shape_job_collect_c",         (DL_FUNC) &_textshaping_shape_job_collect_c,          1},
+    {"_textshaping_shape_job_done_c",            (DL_FUNC) &_textshaping_shape_job_done_c,             1},
+    {"_textshaping_shape_text_async_c",          (DL_FUNC) &_textshaping_shape_text_async_c,          20},
+    {"_textshaping_shape_text_layout_c",         (DL_FUNC) &_textshaping_shape_text_layout_c,         13},
+    {"_textshaping_shape_text_prepare_c",        (DL_FUNC) &_textshaping_shape_text_prepare_c,        19},
+    {"_textshaping_shape_text_wrap_width_c",     (DL_FUNC) &_textshaping_shape_text_wrap_width_c,     5},
     {NULL, NULL, 0}
 };
 }
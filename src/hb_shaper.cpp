@@ -1,9 +1,10 @@
 #include "hb_shaper.h"
+#include "thread_pool.h"
 
 #ifdef NO_HARFBUZZ_FRIBIDI
 
 void init_hb_shaper(DllInfo* dll) {
-
+  register_main_thread();
 }
 
 void unload_hb_shaper(DllInfo *dll) {
@@ -12,18 +13,36 @@ void unload_hb_shaper(DllInfo *dll) {
 
 #else
 
+#include <vector>
+
 static HarfBuzzShaper* hb_shaper;
+static std::vector<HarfBuzzShaper*> hb_worker_shapers;
 
 HarfBuzzShaper& get_hb_shaper() {
   return *hb_shaper;
 }
 
+HarfBuzzShaper& get_hb_worker_shaper(size_t worker) {
+  return *hb_worker_shapers[worker];
+}
+
+void prepare_hb_worker_shapers(size_t n_workers) {
+  while (hb_worker_shapers.size() < n_workers) {
+    hb_worker_shapers.push_back(new HarfBuzzShaper(true));
+  }
+}
+
 void init_hb_shaper(DllInfo* dll) {
+  register_main_thread();
   hb_shaper = new HarfBuzzShaper();
 }
 
 void unload_hb_shaper(DllInfo *dll) {
   delete hb_shaper;
+  for (auto iter = hb_worker_shapers.begin(); iter != hb_worker_shapers.end(); ++iter) {
+    delete *iter;
+  }
+  hb_worker_shapers.clear();
 }
 
 #endif
@@ -5,6 +5,10 @@
 
 #ifndef NO_HARFBUZZ_FRIBIDI
 HarfBuzzShaper& get_hb_shaper();
+// Shapers for use on worker threads. Must be called from the main thread before
+// the workers are started
+HarfBuzzShaper& get_hb_worker_shaper(size_t worker);
+void prepare_hb_worker_shapers(size_t n_workers);
 #endif
 
 [[cpp11::init]]
@@ -0,0 +1,165 @@
+#include "line_break.h"
+#include "line_break_table.h"
+
+#include <algorithm>
+
+LineBreakClass line_break_class(uint32_t codepoint) {
+  if (codepoint < 128) {
+    return LineBreakClass(ascii_line_break_class[codepoint]);
+  }
+  const uint32_t* end = line_break_range_start + n_line_break_ranges;
+  size_t range = std::upper_bound(line_break_range_start, end, codepoint) - line_break_range_start - 1;
+  LineBreakClass cls = LineBreakClass(line_break_range_class[range]);
+  if (cls == LB_HANGUL) {
+    // Every 28th syllable starting from U+AC00 is an LV syllable
+    return (codepoint - 0xAC00) % 28 == 0 ? LB_H2 : LB_H3;
+  }
+  return cls;
+}
+
+namespace {
+
+inline bool is_alphabetic(LineBreakClass cls) {
+  return cls == LB_AL || cls == LB_HL;
+}
+inline bool is_open(LineBreakClass cls) {
+  return cls == LB_OP || cls == LB_OPW;
+}
+inline bool is_close(LineBreakClass cls) {
+  return cls == LB_CL || cls == LB_CP || cls == LB_CPW;
+}
+inline bool is_prefix_postfix(LineBreakClass cls) {
+  return cls == LB_PR || cls == LB_PO;
+}
+inline bool is_hangul(LineBreakClass cls) {
+  return cls == LB_JL || cls == LB_JV || cls == LB_JT || cls == LB_H2 || cls == LB_H3;
+}
+
+// State carried between the characters of a string
+struct BreakState {
+  // The class of the last character that isn't a space, after LB9 and LB10
+  LineBreakClass before = LB_SOT;
+  // Whether spaces come between before and the current character
+  bool spaces = false;
+  // Whether the previous character was a ZWJ (LB8a)
+  bool after_zwj = false;
+  // Whether before is a HY or BA following a HL (LB21a)
+  bool hl_hyphen = false;
+  // The number of regional indicators in a row up to and including before
+  int n_ri = 0;
+};
+
+// Rules LB8 to LB31 for a break before a character of class cls. The
+// mandatory breaks and the rules preventing breaks before spaces and
+// combining marks are handled by the caller
+bool may_break_before(const BreakState& state, LineBreakClass cls) {
+  LineBreakClass before = state.before;
+  if (before == LB_SOT && !state.spaces) return false;              // LB2
+  if (before == LB_ZW) return true;                                 // LB8
+  if (state.after_zwj) return false;                                // LB8a
+  if (cls == LB_WJ || (before == LB_WJ && !state.spaces)) return false; // LB11
+  if (before == LB_GL && !state.spaces) return false;               // LB12
+  if (cls == LB_GL && !state.spaces && before != LB_BA && before != LB_HY) return false; // LB12a
+  if (is_close(cls) || cls == LB_EX || cls == LB_IS || cls == LB_SY) return false; // LB13
+  if (is_open(before)) return false;                                // LB14
+  if (before == LB_QU && is_open(cls)) return false;                // LB15
+  if (is_close(before) && cls == LB_NS) return false;               // LB16
+  if (before == LB_B2 && cls == LB_B2) return false;                // LB17
+  if (state.spaces) return true;                                    // LB18
+  if (cls == LB_QU || before == LB_QU) return false;                // LB19
+  if (cls == LB_CB || before == LB_CB) return true;                 // LB20
+  if (cls == LB_BA || cls == LB_HY || cls == LB_NS || before == LB_BB) return false; // LB21
+  if (state.hl_hyphen) return false;                                // LB21a
+  if (before == LB_SY && cls == LB_HL) return false;                // LB21b
+  if (cls == LB_IN) return false;                                   // LB22
+  if (is_alphabetic(before) && cls == LB_NU) return false;          // LB23
+  if (before == LB_NU && is_alphabetic(cls)) return false;
+  if (before == LB_PR && (cls == LB_ID || cls == LB_EB || cls == LB_EM)) return false; // LB23a
+  if ((before == LB_ID || before == LB_EB || before == LB_EM) && cls == LB_PO) return false;
+  if (is_prefix_postfix(before) && is_alphabetic(cls)) return false; // LB24
+  if (is_alphabetic(before) && is_prefix_postfix(cls)) return false;
+  // LB25 using the pair rules for numbers
+  if ((is_close(before) || before == LB_NU) && is_prefix_postfix(cls)) return false;
+  if (is_prefix_postfix(before) && (is_open(cls) || cls == LB_NU)) return false;
+  if ((before == LB_HY || before == LB_IS || before == LB_NU || before == LB_SY) && cls == LB_NU) return false;
+  if (before == LB_JL && is_hangul(cls) && cls != LB_JT) return false; // LB26
+  if ((before == LB_JV || before == LB_H2) && (cls == LB_JV || cls == LB_JT)) return false;
+  if ((before == LB_JT || before == LB_H3) && cls == LB_JT) return false;
+  if (is_hangul(before) && cls == LB_PO) return false;              // LB27
+  if (before == LB_PR && is_hangul(cls)) return false;
+  if (is_alphabetic(before) && is_alphabetic(cls)) return false;    // LB28
+  if (before == LB_IS && is_alphabetic(cls)) return false;          // LB29
+  if ((is_alphabetic(before) || before == LB_NU) && cls == LB_OP) return false; // LB30
+  if (before == LB_CP && (is_alphabetic(cls) || cls == LB_NU)) return false;
+  if (before == LB_RI && cls == LB_RI && state.n_ri % 2 == 1) return false; // LB30a
+  if (before == LB_EB && cls == LB_EM) return false;                // LB30b
+  return true;                                                      // LB31
+}
+
+}
+
+void find_line_breaks(const uint32_t* string, size_t n_chars,
+                      std::vector<bool>& soft_break, std::vector<bool>& hard_break) {
+  size_t offset = soft_break.size();
+  soft_break.resize(offset + n_chars, false);
+  hard_break.resize(offset + n_chars, false);
+  if (n_chars == 0) return;
+
+  BreakState state;
+  for (size_t i = 0; i < n_chars; ++i) {
+    LineBreakClass cls = line_break_class(string[i]);
+    switch (cls) {
+    // LB4 and LB5: Always break after hard line breaks, except between CR and LF.
+    // LB6: Never break before them
+    case LB_CR:
+      if (i + 1 < n_chars && string[i + 1] == 0x0A) {
+        state = BreakState();
+        continue;
+      }
+      // fallthrough
+    case LB_BK:
+    case LB_LF:
+    case LB_NL:
+      hard_break[offset + i] = true;
+      state = BreakState();
+      continue;
+    // LB7: Never break before spaces or zero width spaces
+    case LB_SP:
+      state.spaces = true;
+      state.after_zwj = false;
+      continue;
+    case LB_ZW:
+      state = BreakState();
+      state.before = LB_ZW;
+      continue;
+    // LB9: Combining marks and ZWJ take the class of the character they follow.
+    // LB10: Otherwise they are treated as AL
+    case LB_CM:
+    case LB_ZWJ:
+      if (!state.spaces && state.before != LB_SOT && state.before != LB_ZW) {
+        state.after_zwj = cls == LB_ZWJ;
+        continue;
+      }
+      break;
+    default:
+      break;
+    }
+    bool zwj = cls == LB_ZWJ;
+    if (cls == LB_CM || cls == LB_ZWJ) cls = LB_AL;
+
+    if (may_break_before(state, cls)) {
+      soft_break[offset + i - 1] = true;
+    }
+
+    state.hl_hyphen = !state.spaces && state.before == LB_HL && (cls == LB_HY || cls == LB_BA);
+    state.n_ri = cls == LB_RI ? (state.before == LB_RI && !state.spaces ? state.n_ri + 1 : 1) : 0;
+    state.before = cls;
+    state.spaces = false;
+    state.after_zwj = zwj;
+  }
+
+  // The end of the string is always a break opportunity
+  if (!hard_break[offset + n_chars - 1]) {
+    soft_break[offset + n_chars - 1] = true;
+  }
+}
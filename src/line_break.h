@@ -0,0 +1,27 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Line break classes of UAX #14 after the resolutions of rule LB1. LB_CPW and
+// LB_OPW are CP and OP characters of east asian width F, W or H, and LB_HANGUL
+// covers all precomposed Hangul syllables (resolved to H2 or H3 on lookup)
+enum LineBreakClass : uint8_t {
+  LB_BK, LB_CR, LB_LF, LB_NL, LB_SP, LB_ZW, LB_ZWJ, LB_CM, LB_WJ, LB_GL,
+  LB_BA, LB_HY, LB_BB, LB_B2, LB_CB, LB_CL, LB_CP, LB_CPW, LB_EX, LB_IN,
+  LB_NS, LB_OP, LB_OPW, LB_QU, LB_IS, LB_NU, LB_PO, LB_PR, LB_SY, LB_AL,
+  LB_HL, LB_ID, LB_EB, LB_EM, LB_H2, LB_H3, LB_JL, LB_JV, LB_JT, LB_RI,
+  LB_HANGUL,
+  // Start of text, or the start of a line after a mandatory break
+  LB_SOT
+};
+
+LineBreakClass line_break_class(uint32_t codepoint);
+
+// Find the line break opportunities of a string following the default
+// algorithm of UAX #14. The results are appended to soft_break and hard_break
+// with one entry per character, true if the line may (soft) or must (hard)
+// break after it. The end of the string is always a break opportunity
+void find_line_breaks(const uint32_t* string, size_t n_chars,
+                      std::vector<bool>& soft_break, std::vector<bool>& hard_break);
@@ -0,0 +1,142 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#ifndef NO_HARFBUZZ_FRIBIDI
+
+#include "string_shape.h"
+
+// Native version of the two tables returned by get_string_shape_c(). Paragraphs
+// are appended one at a time after the shaper has finished them, so the result
+// can be converted to R vectors or exported directly once shaping is done
+struct ShapeResult {
+  // Glyph table
+  std::vector<int32_t> glyph;
+  std::vector<int32_t> index;
+  std::vector<int32_t> metric_id;
+  std::vector<int32_t> string_id;
+  std::vector<double> x_offset;
+  std::vector<double> y_offset;
+  std::vector<std::string> font_path;
+  std::vector<int32_t> font_index;
+  std::vector<double> font_size;
+  std::vector<double> advance;
+  std::vector<double> ascender;
+  std::vector<double> descender;
+
+  // Metrics table
+  std::vector<double> width;
+  std::vector<double> height;
+  std::vector<double> left_bearing;
+  std::vector<double> right_bearing;
+  std::vector<double> top_bearing;
+  std::vector<double> bottom_bearing;
+  std::vector<double> left_border;
+  std::vector<double> top_border;
+  std::vector<double> pen_x;
+  std::vector<double> pen_y;
+  std::vector<bool> ltr;
+
+  size_t n_glyphs() const {
+    return glyph.size();
+  }
+  size_t n_paragraphs() const {
+    return width.size();
+  }
+
+  void add_paragraph(const HarfBuzzShaper& shaper) {
+    size_t n = shaper.glyph_id.size();
+    int32_t paragraph = n_paragraphs() + 1;
+    for (size_t j = 0; j < n; j++) {
+      glyph.push_back((int) shaper.glyph_cluster[j] + 1);
+      index.push_back((int) (shaper.glyph_id[j] == SPACER_CHAR ? R_NaInt : shaper.glyph_id[j]));
+      metric_id.push_back(paragraph);
+      string_id.push_back(shaper.string_id[j] + 1);
+      x_offset.push_back(double(shaper.x_pos[j]) / 64.0);
+      y_offset.push_back(double(shaper.y_pos[j]) / 64.0);
+      font_path.push_back(shaper.fontfile[j]);
+      font_index.push_back((int) shaper.fontindex[j]);
+      font_size.push_back(shaper.fontsize[j]);
+      advance.push_back(double(shaper.advance[j]) / 64.0);
+      ascender.push_back(double(shaper.ascender[j]) / 64.0);
+      descender.push_back(double(shaper.descender[j]) / 64.0);
+    }
+    width.push_back(double(shaper.width) / 64.0);
+    height.push_back(double(shaper.height) / 64.0);
+    left_bearing.push_back(double(shaper.left_bearing) / 64.0);
+    right_bearing.push_back(double(shaper.right_bearing) / 64.0);
+    top_bearing.push_back(double(shaper.top_bearing) / 64.0);
+    bottom_bearing.push_back(double(shaper.bottom_bearing) / 64.0);
+    left_border.push_back(double(shaper.left_border) / 64.0);
+    top_border.push_back(double(shaper.top_border) / 64.0);
+    pen_x.push_back(double(shaper.pen_x) / 64.0);
+    pen_y.push_back(double(shaper.pen_y) / 64.0);
+    ltr.push_back(shaper.dir == 1);
+  }
+
+  // Append a copy of a paragraph of another result, given along with the range
+  // of its glyphs, e.g. for a paragraph repeated in the input
+  void add_paragraph(const ShapeResult& other, size_t paragraph, size_t from, size_t to) {
+    int32_t paragraph_id = n_paragraphs() + 1;
+    for (size_t j = from; j < to; j++) {
+      glyph.push_back(other.glyph[j]);
+      index.push_back(other.index[j]);
+      metric_id.push_back(paragraph_id);
+      string_id.push_back(other.string_id[j]);
+      x_offset.push_back(other.x_offset[j]);
+      y_offset.push_back(other.y_offset[j]);
+      font_path.push_back(other.font_path[j]);
+      font_index.push_back(other.font_index[j]);
+      font_size.push_back(other.font_size[j]);
+      advance.push_back(other.advance[j]);
+      ascender.push_back(other.ascender[j]);
+      descender.push_back(other.descender[j]);
+    }
+    width.push_back(other.width[paragraph]);
+    height.push_back(other.height[paragraph]);
+    left_bearing.push_back(other.left_bearing[paragraph]);
+    right_bearing.push_back(other.right_bearing[paragraph]);
+    top_bearing.push_back(other.top_bearing[paragraph]);
+    bottom_bearing.push_back(other.bottom_bearing[paragraph]);
+    left_border.push_back(other.left_border[paragraph]);
+    top_border.push_back(other.top_border[paragraph]);
+    pen_x.push_back(other.pen_x[paragraph]);
+    pen_y.push_back(other.pen_y[paragraph]);
+    ltr.push_back(other.ltr[paragraph]);
+  }
+
+  // Append the paragraphs of another result, e.g. one shaped on another thread
+  void append(const ShapeResult& other) {
+    int32_t paragraph_offset = n_paragraphs();
+    for (auto iter = other.metric_id.begin(); iter != other.metric_id.end(); ++iter) {
+      metric_id.push_back(*iter + paragraph_offset);
+    }
+    glyph.insert(glyph.end(), other.glyph.begin(), other.glyph.end());
+    index.insert(index.end(), other.index.begin(), other.index.end());
+    string_id.insert(string_id.end(), other.string_id.begin(), other.string_id.end());
+    x_offset.insert(x_offset.end(), other.x_offset.begin(), other.x_offset.end());
+    y_offset.insert(y_offset.end(), other.y_offset.begin(), other.y_offset.end());
+    font_path.insert(font_path.end(), other.font_path.begin(), other.font_path.end());
+    font_index.insert(font_index.end(), other.font_index.begin(), other.font_index.end());
+    font_size.insert(font_size.end(), other.font_size.begin(), other.font_size.end());
+    advance.insert(advance.end(), other.advance.begin(), other.advance.end());
+    ascender.insert(ascender.end(), other.ascender.begin(), other.ascender.end());
+    descender.insert(descender.end(), other.descender.begin(), other.descender.end());
+
+    width.insert(width.end(), other.width.begin(), other.width.end());
+    height.insert(height.end(), other.height.begin(), other.height.end());
+    left_bearing.insert(left_bearing.end(), other.left_bearing.begin(), other.left_bearing.end());
+    right_bearing.insert(right_bearing.end(), other.right_bearing.begin(), other.right_bearing.end());
+    top_bearing.insert(top_bearing.end(), other.top_bearing.begin(), other.top_bearing.end());
+    bottom_bearing.insert(bottom_bearing.end(), other.bottom_bearing.begin(), other.bottom_bearing.end());
+    left_border.insert(left_border.end(), other.left_border.begin(), other.left_border.end());
+    top_border.insert(top_border.end(), other.top_border.begin(), other.top_border.end());
+    pen_x.insert(pen_x.end(), other.pen_x.begin(), other.pen_x.end());
+    pen_y.insert(pen_y.end(), other.pen_y.begin(), other.pen_y.end());
+    ltr.insert(ltr.end(), other.ltr.begin(), other.ltr.end());
+  }
+};
+
+#endif
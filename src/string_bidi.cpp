@@ -7,6 +7,10 @@ std::vector<int> get_bidi_embeddings(const uint32_t* string, int n_chars) {
   return {};
 }
 
+int get_bidi_direction(const std::vector<uint32_t>& string) {
+  return 1;
+}
+
 #else
 
 #include <fribidi.h>
@@ -25,4 +29,12 @@ std::vector<int> get_bidi_embeddings(const std::vector<uint32_t>& string, int& d
   return {embedding_levels.begin(), embedding_levels.end()};
 }
 
+int get_bidi_direction(const std::vector<uint32_t>& string) {
+  std::vector<FriBidiCharType> types(string.size());
+  fribidi_get_bidi_types(string.data(), string.size(), types.data());
+  FriBidiParType direction = fribidi_get_par_direction(types.data(), string.size());
+
+  return FRIBIDI_IS_RTL(direction) ? 2 : 1;
+}
+
 #endif
@@ -4,3 +4,7 @@
 #include <cstdint>
 
 std::vector<int> get_bidi_embeddings(const std::vector<uint32_t>& string, int& direction);
+
+// The paragraph direction (1: LTR, 2: RTL) determined from the first strong
+// character of the string
+int get_bidi_direction(const std::vector<uint32_t>& string);
@@ -6,6 +6,10 @@
 #include "string_metrics.h"
 #include "string_shape.h"
 #include "hb_shaper.h"
+#include "shape_result.h"
+#include "arrow_export.h"
+#include "thread_pool.h"
+#include "wrap_width.h"
 
 #define CPP11_PARTIAL
 #include <cpp11/declarations.hpp>
@@ -14,6 +18,20 @@
 
 #include "utils.h"
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <numeric>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <unordered_map>
+
 using namespace cpp11;
 
 #ifdef NO_HARFBUZZ_FRIBIDI
@@ -24,7 +42,7 @@ list get_string_shape_c(strings string, integers id, strings path, integers inde
                         doubles vjust, doubles width, doubles tracking,
                         doubles indent, doubles hanging, doubles space_before,
                         doubles space_after, integers direction,
-                        list_of<integers> soft_wrap, list_of<integers> hard_wrap) {
+                        bool metrics_only, int threads) {
   Rprintf("textshaping has been compiled without HarfBuzz and/or Fribidi. Please install system dependencies and recompile\n");
   writable::data_frame string_df({
     "string"_nm = writable::logicals(),
@@ -58,8 +76,20 @@ list get_string_shape_c(strings string, integers id, strings path, integers inde
   });
 }
 
+list get_string_shape_arrow_c(strings string, integers id, strings path, integers index,
+                              list_of<list> features, doubles size, doubles res,
+                              doubles lineheight, integers align, doubles hjust,
+                              doubles vjust, doubles width, doubles tracking,
+                              doubles indent, doubles hanging, doubles space_before,
+                              doubles space_after, integers direction,
+                              integers order, int threads) {
+  Rprintf("textshaping has been compiled without HarfBuzz and/or Fribidi. Please install system dependencies and recompile\n");
+  return writable::list();
+}
+
 doubles get_line_width_c(strings string, strings path, integers index, doubles size,
-                         doubles res, logicals include_bearing) {
+                         doubles res, logicals include_bearing, list_of<list> features,
+                         int threads) {
   Rprintf("textshaping has been compiled without HarfBuzz and/or Fribidi. Please install system dependencies and recompile\n");
   return {};
 }
@@ -93,6 +123,138 @@ int ts_string_shape_old(const char* string, FontSettings font_info, double size,
   return 0;
 }
 
+textshaping::ShaperContext* ts_context_create() {
+  return nullptr;
+}
+
+void ts_context_destroy(textshaping::ShaperContext* context) {
+
+}
+
+int ts_context_serve() {
+  return 0;
+}
+
+int ts_context_string_width(textshaping::ShaperContext* context, const char* string,
+                            FontSettings font_info, double size, double res,
+                            int include_bearing, double* width) {
+  *width = 0.0;
+  return 0;
+}
+
+int ts_context_string_shape(textshaping::ShaperContext* context, const char* string,
+                            FontSettings font_info, double size, double res,
+                            std::vector<textshaping::Point>& loc, std::vector<uint32_t>& id,
+                            std::vector<int>& cluster, std::vector<unsigned int>& font,
+                            std::vector<FontSettings>& fallbacks,
+                            std::vector<double>& fallback_scaling) {
+  return 0;
+}
+
+sexp shape_text_async_c(strings string, integers id, strings path, integers index,
+                        list_of<list> features, doubles size, doubles res,
+                        doubles lineheight, integers align, doubles hjust,
+                        doubles vjust, doubles width, doubles tracking,
+                        doubles indent, doubles hanging, doubles space_before,
+                        doubles space_after, integers direction,
+                        bool metrics_only, int threads) {
+  Rprintf("textshaping has been compiled without HarfBuzz and/or Fribidi. Please install system dependencies and recompile\n");
+  return R_NilValue;
+}
+
+bool shape_job_done_c(sexp job) {
+  return true;
+}
+
+list shape_job_collect_c(sexp job) {
+  return writable::list();
+}
+
+sexp shape_text_prepare_c(strings string, integers id, strings path, integers index,
+                          list_of<list> features, doubles size, doubles res,
+                          doubles lineheight, integers align, doubles hjust,
+                          doubles vjust, doubles width, doubles tracking,
+                          doubles indent, doubles hanging, doubles space_before,
+                          doubles space_after, integers direction, int threads) {
+  Rprintf("textshaping has been compiled without HarfBuzz and/or Fribidi. Please install system dependencies and recompile\n");
+  return R_NilValue;
+}
+
+list shape_text_layout_c(sexp text, doubles lineheight, integers align,
+                         doubles hjust, doubles vjust, doubles width,
+                         doubles indent, doubles hanging, doubles space_before,
+                         doubles space_after, list_of<doubles> line_width,
+                         list_of<doubles> line_offset, bool metrics_only) {
+  return writable::list();
+}
+
+doubles shape_text_wrap_width_c(sexp text, integers n_lines, doubles width,
+                                doubles indent, doubles hanging) {
+  return writable::doubles();
+}
+
+doubles fit_text_size_c(strings string, integers id, strings path, integers index,
+                        list_of<list> features, doubles size, doubles res,
+                        doubles lineheight, integers align, doubles hjust,
+                        doubles vjust, doubles width, doubles tracking,
+                        doubles indent, doubles hanging, doubles space_before,
+                        doubles space_after, integers direction, doubles height,
+                        doubles min_scale, doubles max_scale, int threads) {
+  Rprintf("textshaping has been compiled without HarfBuzz and/or Fribidi. Please install system dependencies and recompile\n");
+  return writable::doubles();
+}
+
+doubles get_shape_timings_c() {
+  return writable::doubles();
+}
+
+int ts_string_widths(textshaping::ShaperContext* context, const char** string,
+                     const FontSettings* font_info, const double* size, const double* res,
+                     int include_bearing, int n, double* width) {
+  for (int i = 0; i < n; ++i) {
+    width[i] = 0.0;
+  }
+  return 0;
+}
+
+int ts_string_shapes(textshaping::ShaperContext* context, const char** string,
+                     const FontSettings* font_info, const double* size, const double* res,
+                     int n, std::vector<int>& glyph_offset, std::vector<textshaping::Point>& loc,
+                     std::vector<uint32_t>& id, std::vector<int>& cluster,
+                     std::vector<unsigned int>& font, std::vector<int>& fallback_offset,
+                     std::vector<FontSettings>& fallbacks,
+                     std::vector<double>& fallback_scaling) {
+  glyph_offset.assign(n + 1, 0);
+  fallback_offset.assign(n + 1, 0);
+  return 0;
+}
+
+int ts_string_shape_buffer(textshaping::ShaperContext* context, const char* string,
+                           FontSettings font_info, double size, double res,
+                           unsigned int capacity, textshaping::Point* loc, uint32_t* id,
+                           unsigned int* font, unsigned int* n_glyphs,
+                           unsigned int fallback_capacity, FontSettings* fallbacks,
+                           double* fallback_scaling, unsigned int* n_fallbacks) {
+  *n_glyphs = 0;
+  *n_fallbacks = 0;
+  return 0;
+}
+
+int ts_string_shape_visit(textshaping::ShaperContext* context, const char* string,
+                          FontSettings font_info, double size, double res,
+                          textshaping::GlyphRunVisitor visitor, void* data) {
+  return 0;
+}
+
+int ts_glyph_metrics(textshaping::ShaperContext* context, uint32_t codepoint,
+                     FontSettings font_info, double size, double res, double* ascent,
+                     double* descent, double* width) {
+  *ascent = 0.0;
+  *descent = 0.0;
+  *width = 0.0;
+  return 0;
+}
+
 #else
 
 std::vector< std::vector<FontFeature> > create_font_features(list_of<list> features) {
@@ -130,145 +292,474 @@ std::vector<FontSettings> create_font_settings(strings path, integers index, std
   return res;
 }
 
-list get_string_shape_c(strings string, integers id, strings path, integers index,
-                        list_of<list> features, doubles size, doubles res,
-                        doubles lineheight, integers align, doubles hjust,
-                        doubles vjust, doubles width, doubles tracking,
-                        doubles indent, doubles hanging, doubles space_before,
-                        doubles space_after, integers direction,
-                        list_of<integers> soft_wrap, list_of<integers> hard_wrap) {
+template<typename T>
+std::vector<T> reorder(const std::vector<T>& x, const std::vector<size_t>& order) {
+  std::vector<T> res;
+  res.reserve(order.size());
+  for (auto iter = order.begin(); iter != order.end(); ++iter) {
+    res.push_back(x[*iter]);
+  }
+  return res;
+}
+
+std::vector<double> reorder(const std::vector<double>& x, const std::vector<size_t>& order, const std::vector<double>& scale) {
+  std::vector<double> res;
+  res.reserve(order.size());
+  for (size_t i = 0; i < order.size(); ++i) {
+    res.push_back(x[order[i]] * scale[i]);
+  }
+  return res;
+}
+
+// Native copy of the input to the shaping functions so that paragraphs can be
+// shaped without touching any R objects
+struct ShapeInput {
+  std::vector<std::string> string;
+  std::vector<bool> spacer;
+  std::vector< std::vector<FontFeature> > features;
+  std::vector<FontSettings> fonts;
+  std::vector<double> size;
+  std::vector<double> res;
+  std::vector<double> lineheight;
+  std::vector<int> align;
+  std::vector<double> hjust;
+  std::vector<double> vjust;
+  std::vector<double> width;
+  std::vector<double> tracking;
+  std::vector<double> indent;
+  std::vector<double> hanging;
+  std::vector<double> space_before;
+  std::vector<double> space_after;
+  std::vector<int> direction;
+  // Index of the first string in each paragraph, followed by the number of
+  // strings
+  std::vector<size_t> paragraph_start;
+
+  size_t n_paragraphs() const {
+    return paragraph_start.size() - 1;
+  }
+};
+
+static std::string shape_error(const char* string, const char* path, int error) {
+  std::string msg = "Failed to shape string (";
+  msg.append(string);
+  msg.append(") with font file (");
+  msg.append(path);
+  msg.append(") with freetype error ");
+  msg.append(std::to_string(error));
+  return msg;
+}
+
+// Convert the strings of a paragraph and split them into runs on the shaper.
+// The font size of the strings is multiplied by size_scale
+static void add_paragraph(HarfBuzzShaper& shaper, const ShapeInput& input,
+                          size_t paragraph, double size_scale = 1.0) {
+  size_t start = input.paragraph_start[paragraph];
+  size_t end = input.paragraph_start[paragraph + 1];
+  bool success = false;
+  for (size_t i = start; i < end; ++i) {
+    const char* this_string = input.string[i].c_str();
+    FontSettings font = input.fonts[i];
+    // The size of a spacer is its height which is not scaled
+    double size = input.spacer[i] ? input.size[i] : input.size[i] * size_scale;
+    if (i != start) {
+      success = shaper.add_string(this_string, font, size, input.tracking[i], input.spacer[i]);
+    } else {
+      success = shaper.shape_string(this_string, font, size, input.res[i],
+                                    input.lineheight[i], input.align[i], input.hjust[i], input.vjust[i],
+                                    input.width[i] * 64.0, input.tracking[i], input.indent[i] * 64.0,
+                                    input.hanging[i] * 64.0, input.space_before[i] * 64.0,
+                                    input.space_after[i] * 64.0, input.spacer[i],
+                                    input.direction[i]);
+    }
+    if (!success) {
+      throw std::runtime_error(shape_error(this_string, font.file, shaper.error_code));
+    }
+  }
+}
+
+static void finish_paragraph(HarfBuzzShaper& shaper, bool metrics_only,
+                             size_t n_threads, ShapeResult& result) {
+  if (!shaper.finish_string(metrics_only, n_threads)) {
+    throw std::runtime_error("Failed to finalise string shaping");
+  }
+  result.add_paragraph(shaper);
+}
+
+// Seconds spent in each stage by shape_paragraph() and shape_paragraphs()
+struct StageTimings {
+  double decode = 0.0;
+  double bidi = 0.0;
+  double shape = 0.0;
+  double layout = 0.0;
+
+  void add(const StageTimings& other) {
+    decode += other.decode;
+    bidi += other.bidi;
+    shape += other.shape;
+    layout += other.layout;
+  }
+};
+
+// Timings of the last call to shape_input(), summed over all threads
+static StageTimings last_timings;
+static std::mutex timings_mutex;
+
+static double seconds_since(std::chrono::steady_clock::time_point& start) {
+  std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+  double seconds = std::chrono::duration<double>(now - start).count();
+  start = now;
+  return seconds;
+}
+
+// Shape a single paragraph, using up to n_threads to split up its text. The
+// bidi and shaping stages are then run per part on the worker threads as part
+// of the layout
+static void shape_paragraph(HarfBuzzShaper& shaper, const ShapeInput& input,
+                            size_t paragraph, bool metrics_only, size_t n_threads,
+                            ShapeResult& result, StageTimings& timings) {
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  add_paragraph(shaper, input, paragraph);
+  timings.decode += seconds_since(start);
+  if (!shaper.can_split_string(n_threads)) {
+    shaper.resolve_bidi();
+    timings.bidi += seconds_since(start);
+    shaper.shape_runs();
+    timings.shape += seconds_since(start);
+  }
+  finish_paragraph(shaper, metrics_only, n_threads, result);
+  timings.layout += seconds_since(start);
+}
+
+// The number of paragraphs kept in flight by shape_paragraphs()
+static const size_t STAGE_BATCH_SIZE = 256;
+
+// Shape paragraphs [from, to) in stages: all paragraphs in a batch are decoded,
+// then bidi is resolved for all of them, then their runs are shaped and lastly
+// they are laid out. Each stage thus works on the whole batch with the same
+// code and data hot. Paragraphs are shaped in order of their main font so
+// faces are reused between consecutive paragraphs
+static void shape_paragraphs(HarfBuzzShaper& shaper, const ShapeInput& input,
+                             size_t from, size_t to, bool metrics_only,
+                             ShapeResult& result, StageTimings& timings) {
+  std::vector<ParagraphState> states;
+  std::vector<size_t> font_order;
+  for (size_t batch = from; batch < to; batch += STAGE_BATCH_SIZE) {
+    size_t n = std::min(STAGE_BATCH_SIZE, to - batch);
+    states.assign(n, ParagraphState());
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+    for (size_t i = 0; i < n; ++i) {
+      add_paragraph(shaper, input, batch + i);
+      shaper.store_paragraph(states[i]);
+    }
+    timings.decode += seconds_since(start);
+
+    for (size_t i = 0; i < n; ++i) {
+      shaper.load_paragraph(states[i]);
+      shaper.resolve_bidi();
+      shaper.store_paragraph(states[i]);
+    }
+    timings.bidi += seconds_since(start);
+
+    font_order.resize(n);
+    std::iota(font_order.begin(), font_order.end(), 0);
+    std::stable_sort(font_order.begin(), font_order.end(), [&](size_t a, size_t b) {
+      const FontSettings& font_a = input.fonts[input.paragraph_start[batch + a]];
+      const FontSettings& font_b = input.fonts[input.paragraph_start[batch + b]];
+      int cmp = std::strcmp(font_a.file, font_b.file);
+      return cmp < 0 || (cmp == 0 && font_a.index < font_b.index);
+    });
+    for (size_t i = 0; i < n; ++i) {
+      ParagraphState& state = states[font_order[i]];
+      shaper.load_paragraph(state);
+      shaper.shape_runs();
+      shaper.store_paragraph(state);
+    }
+    timings.shape += seconds_since(start);
+
+    for (size_t i = 0; i < n; ++i) {
+      shaper.load_paragraph(states[i]);
+      finish_paragraph(shaper, metrics_only, 1, result);
+    }
+    timings.layout += seconds_since(start);
+  }
+}
+
+// Read everything from R up front so shaping doesn't need to touch R
+static void read_shape_input(strings string, integers id, strings path, integers index,
+                             list_of<list> features, doubles size, doubles res,
+                             doubles lineheight, integers align, doubles hjust,
+                             doubles vjust, doubles width, doubles tracking,
+                             doubles indent, doubles hanging, doubles space_before,
+                             doubles space_after, integers direction,
+                             ShapeInput& input) {
   int n_strings = string.size();
 
-  // Return Columns
-  writable::integers glyph, glyph_id, metric_id, string_id, fontindex;
-  writable::doubles x_offset, y_offset, widths, heights, left_bearings, right_bearings,
-    top_bearings, bottom_bearings, left_border, top_border, pen_x, pen_y, fontsize,
-    advance, ascender, descender;
-  writable::strings fontpath, str;
-  writable::logicals ltr;
+  if (n_strings == 0) {
+    input.paragraph_start.push_back(0);
+    return;
+  }
 
-  if (n_strings != 0) {
-    if (n_strings != id.size() ||
-        n_strings != path.size() ||
-        n_strings != index.size() ||
-        n_strings != features.size() ||
-        n_strings != size.size() ||
-        n_strings != res.size() ||
-        n_strings != lineheight.size() ||
-        n_strings != align.size() ||
-        n_strings != hjust.size() ||
-        n_strings != vjust.size() ||
-        n_strings != width.size() ||
-        n_strings != tracking.size() ||
-        n_strings != indent.size() ||
-        n_strings != hanging.size() ||
-        n_strings != space_before.size() ||
-        n_strings != space_after.size() ||
-        n_strings != direction.size() ||
-        n_strings != soft_wrap.size() ||
-        n_strings != hard_wrap.size()
-    ) {
-      cpp11::stop("All input must be the same size");
+  if (n_strings != id.size() ||
+      n_strings != path.size() ||
+      n_strings != index.size() ||
+      n_strings != features.size() ||
+      n_strings != size.size() ||
+      n_strings != res.size() ||
+      n_strings != lineheight.size() ||
+      n_strings != align.size() ||
+      n_strings != hjust.size() ||
+      n_strings != vjust.size() ||
+      n_strings != width.size() ||
+      n_strings != tracking.size() ||
+      n_strings != indent.size() ||
+      n_strings != hanging.size() ||
+      n_strings != space_before.size() ||
+      n_strings != space_after.size() ||
+      n_strings != direction.size()
+  ) {
+    cpp11::stop("All input must be the same size");
+  }
+
+  input.features = create_font_features(features);
+  input.fonts = create_font_settings(path, index, input.features);
+  input.size.assign(size.begin(), size.end());
+  input.res.assign(res.begin(), res.end());
+  input.lineheight.assign(lineheight.begin(), lineheight.end());
+  input.align.assign(align.begin(), align.end());
+  input.hjust.assign(hjust.begin(), hjust.end());
+  input.vjust.assign(vjust.begin(), vjust.end());
+  input.width.assign(width.begin(), width.end());
+  input.tracking.assign(tracking.begin(), tracking.end());
+  input.indent.assign(indent.begin(), indent.end());
+  input.hanging.assign(hanging.begin(), hanging.end());
+  input.space_before.assign(space_before.begin(), space_before.end());
+  input.space_after.assign(space_after.begin(), space_after.end());
+  input.direction.assign(direction.begin(), direction.end());
+  for (int i = 0; i < n_strings; ++i) {
+    input.string.push_back(Rf_translateCharUTF8(string[i]));
+    input.spacer.push_back(cpp11::is_na(string[i]));
+    if (i == 0 || id[i] != id[i - 1]) {
+      input.paragraph_start.push_back(i);
     }
-    auto all_features = create_font_features(features);
-    auto fonts = create_font_settings(path, index, all_features);
+  }
+  input.paragraph_start.push_back(n_strings);
+}
 
-    // Shape the text
-    int cur_id = id[0] - 1; // make sure it differs from first
-    bool success = false;
+static void shape_input(const ShapeInput& input, bool metrics_only, int threads,
+                        ShapeResult& result) {
+  size_t n_paragraphs = input.n_paragraphs();
+  if (n_paragraphs == 0) {
+    return;
+  }
+  size_t n_threads = n_threads_for(threads, n_paragraphs);
 
-    HarfBuzzShaper& shaper = get_hb_shaper();
-    std::vector<int> soft, hard;
-    for (int i = 0; i < n_strings; ++i) {
-      const char* this_string = Rf_translateCharUTF8(string[i]);
-      int this_id = id[i];
-      soft.assign(soft_wrap[i].begin(), soft_wrap[i].end());
-      hard.assign(hard_wrap[i].begin(), hard_wrap[i].end());
-      if (cur_id == this_id) {
-        success = shaper.add_string(this_string, fonts[i], size[i], tracking[i], cpp11::is_na(string[i]), soft, hard);
-
-        if (!success) {
-          cpp11::stop("Failed to shape string (%s) with font file (%s) with freetype error %i", this_string, Rf_translateCharUTF8(path[i]), shaper.error_code);
-        }
-      } else {
-        cur_id = this_id;
-        success = shaper.shape_string(this_string, fonts[i], size[i], res[i],
-                                      lineheight[i], align[i], hjust[i], vjust[i],
-                                      width[i] * 64.0, tracking[i], indent[i] * 64.0,
-                                      hanging[i] * 64.0, space_before[i] * 64.0,
-                                      space_after[i] * 64.0, cpp11::is_na(string[i]),
-                                      direction[i], soft, hard);
-
-        if (!success) {
-          cpp11::stop("Failed to shape string (%s) with font file (%s) with freetype error %i", this_string, Rf_translateCharUTF8(STRING_ELT(path, i)), shaper.error_code);
-        }
-      }
-      bool store_string = i == n_strings - 1 || cur_id != INTEGER(id)[i + 1];
-      if (store_string) {
-        success = shaper.finish_string();
-        if (!success) {
-          cpp11::stop("Failed to finalise string shaping");
-        }
-        int n_glyphs = shaper.glyph_id.size();
-        for (int j = 0; j < n_glyphs; j++) {
-          glyph.push_back((int) shaper.glyph_cluster[j] + 1);
-          glyph_id.push_back((int) (shaper.glyph_id[j] == SPACER_CHAR ? R_NaInt : shaper.glyph_id[j]));
-          metric_id.push_back(pen_x.size() + 1);
-          string_id.push_back(shaper.string_id[j] + 1);
-          x_offset.push_back(double(shaper.x_pos[j]) / 64.0);
-          y_offset.push_back(double(shaper.y_pos[j]) / 64.0);
-          fontpath.push_back(shaper.fontfile[j]);
-          fontindex.push_back((int) shaper.fontindex[j]);
-          fontsize.push_back(shaper.fontsize[j]);
-          advance.push_back(double(shaper.advance[j]) / 64.0);
-          ascender.push_back(double(shaper.ascender[j]) / 64.0);
-          descender.push_back(double(shaper.descender[j]) / 64.0);
-        }
-        widths.push_back(double(shaper.width) / 64.0);
-        heights.push_back(double(shaper.height) / 64.0);
-        left_bearings.push_back(double(shaper.left_bearing) / 64.0);
-        right_bearings.push_back(double(shaper.right_bearing) / 64.0);
-        top_bearings.push_back(double(shaper.top_bearing) / 64.0);
-        bottom_bearings.push_back(double(shaper.bottom_bearing) / 64.0);
-        left_border.push_back(double(shaper.left_border) / 64.0);
-        top_border.push_back(double(shaper.top_border) / 64.0);
-        pen_x.push_back(double(shaper.pen_x) / 64.0);
-        pen_y.push_back(double(shaper.pen_y) / 64.0);
-        ltr.push_back(shaper.dir == 1);
-      }
+  {
+    std::lock_guard<std::mutex> lock(timings_mutex);
+    last_timings = StageTimings();
+  }
+
+  if (n_paragraphs == 1) {
+    // With a single paragraph the threads are used to split up its text instead
+    StageTimings timings;
+    shape_paragraph(get_hb_shaper(), input, 0, metrics_only,
+                    n_threads_for(threads, SIZE_MAX), result, timings);
+    std::lock_guard<std::mutex> lock(timings_mutex);
+    last_timings = timings;
+    return;
+  }
+
+  if (n_threads == 1) {
+    StageTimings timings;
+    shape_paragraphs(get_hb_shaper(), input, 0, n_paragraphs, metrics_only, result, timings);
+    std::lock_guard<std::mutex> lock(timings_mutex);
+    last_timings = timings;
+    return;
+  }
+
+  // Paragraphs are shaped in chunks with their own result so these can be
+  // merged in order afterwards. Using several chunks per thread lets idle
+  // workers take over from workers stuck with long paragraphs
+  size_t n_chunks = std::min(n_paragraphs, n_threads * 8);
+  std::vector<ShapeResult> chunk_results(n_chunks);
+  prepare_hb_worker_shapers(n_threads);
+  parallel_for(n_chunks, n_threads, [&](size_t chunk, size_t worker) {
+    HarfBuzzShaper& shaper = get_hb_worker_shaper(worker);
+    size_t from = chunk * n_paragraphs / n_chunks;
+    size_t to = (chunk + 1) * n_paragraphs / n_chunks;
+    StageTimings timings;
+    shape_paragraphs(shaper, input, from, to, metrics_only, chunk_results[chunk], timings);
+    std::lock_guard<std::mutex> lock(timings_mutex);
+    last_timings.add(timings);
+  });
+  for (size_t i = 0; i < n_chunks; ++i) {
+    result.append(chunk_results[i]);
+  }
+}
+
+doubles get_shape_timings_c() {
+  std::lock_guard<std::mutex> lock(timings_mutex);
+  return writable::doubles({
+    "decode"_nm = last_timings.decode,
+    "bidi"_nm = last_timings.bidi,
+    "shape"_nm = last_timings.shape,
+    "layout"_nm = last_timings.layout
+  });
+}
+
+template <typename T>
+static void append_bytes(std::string& key, const T& value) {
+  key.append(reinterpret_cast<const char*>(&value), sizeof(T));
+}
+
+// The strings of a paragraph along with all their settings, so paragraphs
+// that are repeated in the input can be recognised
+static std::string paragraph_key(const ShapeInput& input, size_t paragraph) {
+  std::string key;
+  for (size_t i = input.paragraph_start[paragraph]; i < input.paragraph_start[paragraph + 1]; ++i) {
+    append_bytes(key, input.string[i].size());
+    key.append(input.string[i]);
+    append_bytes(key, bool(input.spacer[i]));
+    size_t file_length = std::strlen(input.fonts[i].file);
+    append_bytes(key, file_length);
+    key.append(input.fonts[i].file, file_length);
+    append_bytes(key, input.fonts[i].index);
+    append_bytes(key, input.features[i].size());
+    for (auto feature = input.features[i].begin(); feature != input.features[i].end(); ++feature) {
+      key.append(feature->feature, 4);
+      append_bytes(key, feature->setting);
     }
-    str = writable::strings(pen_x.size());
+    append_bytes(key, input.size[i]);
+    append_bytes(key, input.res[i]);
+    append_bytes(key, input.lineheight[i]);
+    append_bytes(key, input.align[i]);
+    append_bytes(key, input.hjust[i]);
+    append_bytes(key, input.vjust[i]);
+    append_bytes(key, input.width[i]);
+    append_bytes(key, input.tracking[i]);
+    append_bytes(key, input.indent[i]);
+    append_bytes(key, input.hanging[i]);
+    append_bytes(key, input.space_before[i]);
+    append_bytes(key, input.space_after[i]);
+    append_bytes(key, input.direction[i]);
+  }
+  return key;
+}
+
+// Reduce the input to its distinct paragraphs, setting source[p] to the
+// paragraph of the reduced input that paragraph p is a copy of. Returns false,
+// leaving the input as is, if no paragraph is repeated
+static bool unique_paragraphs(ShapeInput& input, std::vector<size_t>& source) {
+  size_t n_paragraphs = input.n_paragraphs();
+  std::unordered_map<std::string, size_t> seen;
+  std::vector<size_t> unique;
+  source.resize(n_paragraphs);
+  for (size_t p = 0; p < n_paragraphs; ++p) {
+    auto match = seen.emplace(paragraph_key(input, p), unique.size());
+    if (match.second) unique.push_back(p);
+    source[p] = match.first->second;
+  }
+  if (unique.size() == n_paragraphs) return false;
+
+  ShapeInput reduced;
+  for (auto p = unique.begin(); p != unique.end(); ++p) {
+    reduced.paragraph_start.push_back(reduced.string.size());
+    for (size_t i = input.paragraph_start[*p]; i < input.paragraph_start[*p + 1]; ++i) {
+      reduced.string.push_back(std::move(input.string[i]));
+      reduced.spacer.push_back(input.spacer[i]);
+      reduced.features.push_back(std::move(input.features[i]));
+      reduced.fonts.push_back(input.fonts[i]);
+      reduced.size.push_back(input.size[i]);
+      reduced.res.push_back(input.res[i]);
+      reduced.lineheight.push_back(input.lineheight[i]);
+      reduced.align.push_back(input.align[i]);
+      reduced.hjust.push_back(input.hjust[i]);
+      reduced.vjust.push_back(input.vjust[i]);
+      reduced.width.push_back(input.width[i]);
+      reduced.tracking.push_back(input.tracking[i]);
+      reduced.indent.push_back(input.indent[i]);
+      reduced.hanging.push_back(input.hanging[i]);
+      reduced.space_before.push_back(input.space_before[i]);
+      reduced.space_after.push_back(input.space_after[i]);
+      reduced.direction.push_back(input.direction[i]);
+    }
+  }
+  reduced.paragraph_start.push_back(reduced.string.size());
+  // The fonts must point to the features of the reduced input
+  for (size_t i = 0; i < reduced.fonts.size(); ++i) {
+    reduced.fonts[i].features = reduced.features[i].data();
+  }
+  input = std::move(reduced);
+  return true;
+}
+
+void shape_strings(strings string, integers id, strings path, integers index,
+                   list_of<list> features, doubles size, doubles res,
+                   doubles lineheight, integers align, doubles hjust,
+                   doubles vjust, doubles width, doubles tracking,
+                   doubles indent, doubles hanging, doubles space_before,
+                   doubles space_after, integers direction,
+                   bool metrics_only, int threads, ShapeResult& result) {
+  ShapeInput input;
+  read_shape_input(string, id, path, index, features, size, res, lineheight, align,
+                   hjust, vjust, width, tracking, indent, hanging, space_before,
+                   space_after, direction, input);
+
+  // Repeated paragraphs, e.g. axis labels, are shaped once and copied
+  std::vector<size_t> source;
+  if (!unique_paragraphs(input, source)) {
+    shape_input(input, metrics_only, threads, result);
+    return;
+  }
+  ShapeResult unique;
+  shape_input(input, metrics_only, threads, unique);
+  std::vector<size_t> glyph_start(unique.n_paragraphs() + 1, 0);
+  for (auto iter = unique.metric_id.begin(); iter != unique.metric_id.end(); ++iter) {
+    glyph_start[*iter]++;
+  }
+  std::partial_sum(glyph_start.begin(), glyph_start.end(), glyph_start.begin());
+  for (size_t p = 0; p < source.size(); ++p) {
+    size_t u = source[p];
+    result.add_paragraph(unique, u, glyph_start[u], glyph_start[u + 1]);
+  }
+}
+
+static list shape_result_to_list(const ShapeResult& result) {
+  writable::logicals ltr;
+  for (size_t i = 0; i < result.ltr.size(); ++i) {
+    ltr.push_back(static_cast<bool>(result.ltr[i]));
   }
 
   writable::data_frame string_df({
-    "string"_nm = str,
-    "width"_nm = widths,
-    "height"_nm = heights,
-    "left_bearing"_nm = left_bearings,
-    "right_bearing"_nm = right_bearings,
-    "top_bearing"_nm = top_bearings,
-    "bottom_bearing"_nm = bottom_bearings,
-    "left_border"_nm = left_border,
-    "top_border"_nm = top_border,
-    "pen_x"_nm = pen_x,
-    "pen_y"_nm = pen_y,
+    "string"_nm = writable::strings(result.n_paragraphs()),
+    "width"_nm = result.width,
+    "height"_nm = result.height,
+    "left_bearing"_nm = result.left_bearing,
+    "right_bearing"_nm = result.right_bearing,
+    "top_bearing"_nm = result.top_bearing,
+    "bottom_bearing"_nm = result.bottom_bearing,
+    "left_border"_nm = result.left_border,
+    "top_border"_nm = result.top_border,
+    "pen_x"_nm = result.pen_x,
+    "pen_y"_nm = result.pen_y,
     "ltr"_nm = ltr
   });
   string_df.attr("class") = writable::strings({"tbl_df", "tbl", "data.frame"});
 
   writable::data_frame info_df({
-    "glyph"_nm = glyph,
-    "index"_nm = glyph_id,
-    "metric_id"_nm = metric_id,
-    "string_id"_nm = string_id,
-    "x_offset"_nm = x_offset,
-    "y_offset"_nm = y_offset,
-    "font_path"_nm = fontpath,
-    "font_index"_nm = fontindex,
-    "font_size"_nm = fontsize,
-    "advance"_nm = advance,
-    "ascender"_nm = ascender,
-    "descender"_nm = descender
+    "glyph"_nm = result.glyph,
+    "index"_nm = result.index,
+    "metric_id"_nm = result.metric_id,
+    "string_id"_nm = result.string_id,
+    "x_offset"_nm = result.x_offset,
+    "y_offset"_nm = result.y_offset,
+    "font_path"_nm = result.font_path,
+    "font_index"_nm = result.font_index,
+    "font_size"_nm = result.font_size,
+    "advance"_nm = result.advance,
+    "ascender"_nm = result.ascender,
+    "descender"_nm = result.descender
   });
   info_df.attr("class") = writable::strings({"tbl_df", "tbl", "data.frame"});
 
@@ -278,10 +769,656 @@ list get_string_shape_c(strings string, integers id, strings path, integers inde
   });
 }
 
+list get_string_shape_c(strings string, integers id, strings path, integers index,
+                        list_of<list> features, doubles size, doubles res,
+                        doubles lineheight, integers align, doubles hjust,
+                        doubles vjust, doubles width, doubles tracking,
+                        doubles indent, doubles hanging, doubles space_before,
+                        doubles space_after, integers direction,
+                        bool metrics_only, int threads) {
+  ShapeResult result;
+  shape_strings(string, id, path, index, features, size, res, lineheight, align,
+                hjust, vjust, width, tracking, indent, hanging, space_before,
+                space_after, direction, metrics_only, threads, result);
+
+  return shape_result_to_list(result);
+}
+
+list get_string_shape_arrow_c(strings string, integers id, strings path, integers index,
+                              list_of<list> features, doubles size, doubles res,
+                              doubles lineheight, integers align, doubles hjust,
+                              doubles vjust, doubles width, doubles tracking,
+                              doubles indent, doubles hanging, doubles space_before,
+                              doubles space_after, integers direction,
+                              integers order, int threads) {
+  ShapeResult result;
+  shape_strings(string, id, path, index, features, size, res, lineheight, align,
+                hjust, vjust, width, tracking, indent, hanging, space_before,
+                space_after, direction, false, threads, result);
+
+  // Do the same post-processing as shape_text() does in R. Glyphs are mapped
+  // back to the input order and all measures are converted from pixels to
+  // points
+  int n_strings = string.size();
+  std::vector<std::string> paragraph_string;
+  std::vector<int> paragraph_start;
+  for (int i = 0; i < n_strings; ++i) {
+    if (i == 0 || id[i] != id[i - 1]) {
+      paragraph_string.emplace_back();
+      paragraph_start.push_back(i);
+    }
+    paragraph_string.back().append(cpp11::is_na(string[i]) ? "NA" : Rf_translateCharUTF8(string[i]));
+  }
+  size_t n_paragraphs = result.n_paragraphs();
+  std::vector<double>* metric_cols[] = {
+    &result.width, &result.height, &result.left_bearing, &result.right_bearing,
+    &result.top_bearing, &result.bottom_bearing, &result.left_border,
+    &result.top_border, &result.pen_x, &result.pen_y
+  };
+  for (size_t i = 0; i < n_paragraphs; ++i) {
+    double res_mod = 72.0 / res[paragraph_start[i]];
+    for (auto col : metric_cols) {
+      (*col)[i] *= res_mod;
+    }
+  }
+
+  size_t n_glyphs = result.n_glyphs();
+  for (size_t i = 0; i < n_glyphs; ++i) {
+    int sorted_id = paragraph_start[result.metric_id[i] - 1] + result.string_id[i] - 1;
+    result.string_id[i] = order[sorted_id];
+  }
+  std::vector<size_t> glyph_order(n_glyphs);
+  std::iota(glyph_order.begin(), glyph_order.end(), 0);
+  std::stable_sort(glyph_order.begin(), glyph_order.end(), [&result](size_t a, size_t b) {
+    return result.string_id[a] < result.string_id[b];
+  });
+
+  ArrowTable glyphs;
+  glyphs.add_column("glyph", reorder(result.glyph, glyph_order));
+  glyphs.add_column("index", reorder(result.index, glyph_order), R_NaInt);
+  glyphs.add_column("metric_id", reorder(result.metric_id, glyph_order));
+  glyphs.add_column("string_id", reorder(result.string_id, glyph_order));
+  std::vector<double> glyph_res_mod(n_glyphs);
+  for (size_t i = 0; i < n_glyphs; ++i) {
+    glyph_res_mod[i] = 72.0 / res[result.string_id[glyph_order[i]] - 1];
+  }
+  glyphs.add_column("x_offset", reorder(result.x_offset, glyph_order, glyph_res_mod));
+  glyphs.add_column("y_offset", reorder(result.y_offset, glyph_order, glyph_res_mod));
+  glyphs.add_column("font_path", reorder(result.font_path, glyph_order));
+  glyphs.add_column("font_index", reorder(result.font_index, glyph_order));
+  glyphs.add_column("font_size", reorder(result.font_size, glyph_order));
+  glyphs.add_column("advance", reorder(result.advance, glyph_order, glyph_res_mod));
+  glyphs.add_column("ascender", reorder(result.ascender, glyph_order, glyph_res_mod));
+  glyphs.add_column("descender", reorder(result.descender, glyph_order, glyph_res_mod));
+
+  ArrowTable metrics;
+  metrics.add_column("string", paragraph_string);
+  metrics.add_column("width", std::move(result.width));
+  metrics.add_column("height", std::move(result.height));
+  metrics.add_column("left_bearing", std::move(result.left_bearing));
+  metrics.add_column("right_bearing", std::move(result.right_bearing));
+  metrics.add_column("top_bearing", std::move(result.top_bearing));
+  metrics.add_column("bottom_bearing", std::move(result.bottom_bearing));
+  metrics.add_column("left_border", std::move(result.left_border));
+  metrics.add_column("top_border", std::move(result.top_border));
+  metrics.add_column("pen_x", std::move(result.pen_x));
+  metrics.add_column("pen_y", std::move(result.pen_y));
+  metrics.add_column("ltr", result.ltr);
+
+  ArrowSchema schema;
+  ArrowArray array;
+  glyphs.export_to(&schema, &array);
+  sexp shape_arrow = arrow_table_to_sexp(&schema, &array);
+  metrics.export_to(&schema, &array);
+  sexp metrics_arrow = arrow_table_to_sexp(&schema, &array);
+
+  return writable::list({
+    "shape"_nm = shape_arrow,
+    "metrics"_nm = metrics_arrow
+  });
+}
+
+// A batch of paragraphs shaped on background threads while R carries on. Each
+// thread has its own shaper. As R code may call systemfonts at any time the
+// threads never call it themselves: font fallback and emoji lookups are queued
+// for the main thread and resolved when the job is polled or collected
+class ShapeJob {
+public:
+  ShapeJob(ShapeInput&& _input, bool _metrics_only, size_t n_threads) :
+    input(std::move(_input)),
+    metrics_only(_metrics_only),
+    n_chunks(std::min(input.n_paragraphs(), n_threads * 8)),
+    chunk_results(n_chunks),
+    result(),
+    threads(),
+    next_chunk(0),
+    n_finished(0),
+    cancelled(false),
+    collected(false),
+    main_queue(),
+    error_mutex(),
+    error() {
+    try {
+      for (size_t i = 0; i < n_threads; ++i) {
+        threads.emplace_back(&ShapeJob::run, this);
+      }
+    } catch (...) {
+      cancel();
+      throw;
+    }
+  }
+  ~ShapeJob() {
+    cancel();
+  }
+
+  // Resolve the lookups the threads are waiting on and check whether the job
+  // has finished
+  bool poll() {
+    if (!collected) main_queue.serve();
+    return done();
+  }
+
+  // Wait for the job to finish and return the result. Errors raised during
+  // shaping are rethrown here
+  const ShapeResult& collect() {
+    if (!collected) {
+      main_queue.serve_until([this]() { return done(); });
+      join();
+      if (error) std::rethrow_exception(error);
+      for (size_t i = 0; i < n_chunks; ++i) {
+        result.append(chunk_results[i]);
+      }
+      chunk_results.clear();
+      collected = true;
+    }
+    return result;
+  }
+
+private:
+  ShapeInput input;
+  bool metrics_only;
+  size_t n_chunks;
+  std::vector<ShapeResult> chunk_results;
+  ShapeResult result;
+  std::vector<std::thread> threads;
+  std::atomic<size_t> next_chunk;
+  std::atomic<size_t> n_finished;
+  std::atomic<bool> cancelled;
+  bool collected;
+  MainThreadQueue main_queue;
+  std::mutex error_mutex;
+  std::exception_ptr error;
+
+  bool done() const {
+    return n_finished == threads.size();
+  }
+
+  void run() {
+    main_queue.attach();
+    try {
+      HarfBuzzShaper shaper(true);
+      size_t n_paragraphs = input.n_paragraphs();
+      while (!cancelled) {
+        size_t chunk = next_chunk++;
+        if (chunk >= n_chunks) break;
+        size_t from = chunk * n_paragraphs / n_chunks;
+        size_t to = (chunk + 1) * n_paragraphs / n_chunks;
+        StageTimings timings;
+        shape_paragraphs(shaper, input, from, to, metrics_only, chunk_results[chunk], timings);
+      }
+    } catch (...) {
+      std::lock_guard<std::mutex> lock(error_mutex);
+      if (!error) error = std::current_exception();
+      cancelled = true;
+    }
+    n_finished++;
+    main_queue.detach();
+  }
+
+  // Stop the threads, failing any lookups they are waiting on
+  void cancel() {
+    cancelled = true;
+    main_queue.close();
+    join();
+  }
+
+  void join() {
+    for (auto iter = threads.begin(); iter != threads.end(); ++iter) {
+      if (iter->joinable()) iter->join();
+    }
+  }
+};
+
+static void finalize_shape_job(SEXP xptr) {
+  ShapeJob* job = static_cast<ShapeJob*>(R_ExternalPtrAddr(xptr));
+  if (job == nullptr) return;
+  delete job;
+  R_ClearExternalPtr(xptr);
+}
+
+static ShapeJob* get_shape_job(sexp job) {
+  if (TYPEOF(job) != EXTPTRSXP || R_ExternalPtrAddr(job) == nullptr) {
+    cpp11::stop("Invalid shaping job");
+  }
+  return static_cast<ShapeJob*>(R_ExternalPtrAddr(job));
+}
+
+sexp shape_text_async_c(strings string, integers id, strings path, integers index,
+                        list_of<list> features, doubles size, doubles res,
+                        doubles lineheight, integers align, doubles hjust,
+                        doubles vjust, doubles width, doubles tracking,
+                        doubles indent, doubles hanging, doubles space_before,
+                        doubles space_after, integers direction,
+                        bool metrics_only, int threads) {
+  ShapeInput input;
+  read_shape_input(string, id, path, index, features, size, res, lineheight, align,
+                   hjust, vjust, width, tracking, indent, hanging, space_before,
+                   space_after, direction, input);
+  size_t n_threads = n_threads_for(threads, input.n_paragraphs());
+
+  // Register the finalizer before starting the job so it can't leak
+  sexp xptr = R_MakeExternalPtr(nullptr, R_NilValue, R_NilValue);
+  R_RegisterCFinalizerEx(xptr, finalize_shape_job, TRUE);
+  R_SetExternalPtrAddr(xptr, new ShapeJob(std::move(input), metrics_only, n_threads));
+  return xptr;
+}
+
+bool shape_job_done_c(sexp job) {
+  return get_shape_job(job)->poll();
+}
+
+list shape_job_collect_c(sexp job) {
+  return shape_result_to_list(get_shape_job(job)->collect());
+}
+
+// Paragraphs shaped by shape_text_prepare_c() and kept for shape_text_layout_c()
+struct PreparedText {
+  std::vector<size_t> paragraph_start;
+  std::vector<ShapedParagraph> paragraphs;
+};
+
+static void finalize_prepared_text(SEXP xptr) {
+  PreparedText* text = static_cast<PreparedText*>(R_ExternalPtrAddr(xptr));
+  if (text == nullptr) return;
+  delete text;
+  R_ClearExternalPtr(xptr);
+}
+
+static PreparedText* get_prepared_text(sexp text) {
+  if (TYPEOF(text) != EXTPTRSXP || R_ExternalPtrAddr(text) == nullptr) {
+    cpp11::stop("Invalid prepared text");
+  }
+  return static_cast<PreparedText*>(R_ExternalPtrAddr(text));
+}
+
+sexp shape_text_prepare_c(strings string, integers id, strings path, integers index,
+                          list_of<list> features, doubles size, doubles res,
+                          doubles lineheight, integers align, doubles hjust,
+                          doubles vjust, doubles width, doubles tracking,
+                          doubles indent, doubles hanging, doubles space_before,
+                          doubles space_after, integers direction, int threads) {
+  ShapeInput input;
+  read_shape_input(string, id, path, index, features, size, res, lineheight, align,
+                   hjust, vjust, width, tracking, indent, hanging, space_before,
+                   space_after, direction, input);
+
+  std::unique_ptr<PreparedText> text(new PreparedText());
+  size_t n_paragraphs = input.n_paragraphs();
+  text->paragraph_start = input.paragraph_start;
+  text->paragraphs.resize(n_paragraphs);
+  size_t n_threads = n_threads_for(threads, n_paragraphs);
+  if (n_threads > 1) {
+    prepare_hb_worker_shapers(n_threads);
+    parallel_for(n_paragraphs, n_threads, [&](size_t paragraph, size_t worker) {
+      HarfBuzzShaper& shaper = get_hb_worker_shaper(worker);
+      add_paragraph(shaper, input, paragraph);
+      shaper.store_shaped_paragraph(text->paragraphs[paragraph]);
+    });
+  } else {
+    HarfBuzzShaper& shaper = get_hb_shaper();
+    for (size_t i = 0; i < n_paragraphs; ++i) {
+      add_paragraph(shaper, input, i);
+      shaper.store_shaped_paragraph(text->paragraphs[i]);
+    }
+  }
+
+  sexp xptr = R_MakeExternalPtr(nullptr, R_NilValue, R_NilValue);
+  R_RegisterCFinalizerEx(xptr, finalize_prepared_text, TRUE);
+  R_SetExternalPtrAddr(xptr, text.release());
+  return xptr;
+}
+
+list shape_text_layout_c(sexp text, doubles lineheight, integers align,
+                         doubles hjust, doubles vjust, doubles width,
+                         doubles indent, doubles hanging, doubles space_before,
+                         doubles space_after, list_of<doubles> line_width,
+                         list_of<doubles> line_offset, bool metrics_only) {
+  const PreparedText* prepared = get_prepared_text(text);
+  R_xlen_t n_strings = prepared->paragraph_start.back();
+  if (n_strings != lineheight.size() ||
+      n_strings != align.size() ||
+      n_strings != hjust.size() ||
+      n_strings != vjust.size() ||
+      n_strings != width.size() ||
+      n_strings != indent.size() ||
+      n_strings != hanging.size() ||
+      n_strings != space_before.size() ||
+      n_strings != space_after.size()
+  ) {
+    cpp11::stop("All input must be the same size");
+  }
+  R_xlen_t n_paragraphs = prepared->paragraphs.size();
+  if (n_paragraphs != line_width.size() || n_paragraphs != line_offset.size()) {
+    cpp11::stop("Line boxes must be given for each paragraph");
+  }
+
+  // Paragraph level settings are taken from the first string in each
+  // paragraph, as when shaping
+  HarfBuzzShaper& shaper = get_hb_shaper();
+  ShapeResult result;
+  std::vector<int32_t> box_width;
+  std::vector<int32_t> box_offset;
+  for (R_xlen_t i = 0; i < n_paragraphs; ++i) {
+    size_t first = prepared->paragraph_start[i];
+    box_width.clear();
+    box_offset.clear();
+    doubles paragraph_width = line_width[i];
+    doubles paragraph_offset = line_offset[i];
+    for (R_xlen_t j = 0; j < paragraph_width.size(); ++j) {
+      box_width.push_back(paragraph_width[j] * 64.0);
+    }
+    for (R_xlen_t j = 0; j < paragraph_offset.size(); ++j) {
+      box_offset.push_back(paragraph_offset[j] * 64.0);
+    }
+    if (!shaper.layout_paragraph(prepared->paragraphs[i], lineheight[first],
+                                 align[first], hjust[first], vjust[first],
+                                 width[first] * 64.0, indent[first] * 64.0,
+                                 hanging[first] * 64.0, space_before[first] * 64.0,
+                                 space_after[first] * 64.0, metrics_only,
+                                 box_width, box_offset)) {
+      cpp11::stop("Failed to finalise string shaping");
+    }
+    result.add_paragraph(shaper);
+  }
+  return shape_result_to_list(result);
+}
+
+doubles shape_text_wrap_width_c(sexp text, integers n_lines, doubles width,
+                                doubles indent, doubles hanging) {
+  const PreparedText* prepared = get_prepared_text(text);
+  R_xlen_t n_strings = prepared->paragraph_start.back();
+  if (n_strings != n_lines.size() ||
+      n_strings != width.size() ||
+      n_strings != indent.size() ||
+      n_strings != hanging.size()
+  ) {
+    cpp11::stop("All input must be the same size");
+  }
+
+  writable::doubles result(prepared->paragraphs.size());
+  for (size_t i = 0; i < prepared->paragraphs.size(); ++i) {
+    size_t first = prepared->paragraph_start[i];
+    WrapWidthSolver solver(prepared->paragraphs[i].embeddings,
+                           indent[first] * 64.0, hanging[first] * 64.0);
+    // Without a line count keep the number of lines the text wraps into at
+    // the given width (balanced wrapping)
+    size_t lines = 0;
+    if (n_lines[first] != NA_INTEGER) {
+      lines = std::max(n_lines[first], 1);
+    } else if (width[first] >= 0) {
+      lines = solver.n_lines(width[first] * 64.0 + 1);
+    }
+    result[i] = double(solver.min_width(lines)) / 64.0;
+  }
+  return result;
+}
+
+// The relative precision of the scale found by fit_paragraph_scale()
+static const double FIT_SCALE_TOLERANCE = 1e-3;
+
+// Whether paragraph fits in a box of width x height (in 26.6 pixels) when its
+// font size is scaled by scale. For scalable fonts all measures of the layout
+// grow in proportion to the font size, so this is the same as laying out the
+// text at its current size in a box shrunk by scale. Indent and paragraph
+// spacing don't depend on the font size and are shrunk as well. Text only fits
+// if no word has to be broken to fit the width
+static bool paragraph_fits(HarfBuzzShaper& shaper, const ShapedParagraph& paragraph,
+                           const ShapeInput& input, size_t first, double width,
+                           double height, double scale) {
+  double indent = input.indent[first] * 64.0 / scale;
+  double hanging = input.hanging[first] * 64.0 / scale;
+  double line_width = width / scale;
+  WrapWidthSolver solver(paragraph.embeddings, indent, hanging);
+  if (solver.n_lines(line_width + 1) == SIZE_MAX) {
+    return false;
+  }
+  if (!shaper.layout_paragraph(paragraph, input.lineheight[first], input.align[first],
+                               input.hjust[first], input.vjust[first], line_width,
+                               indent, hanging, input.space_before[first] * 64.0 / scale,
+                               input.space_after[first] * 64.0 / scale, true)) {
+    throw std::runtime_error("Failed to finalise string shaping");
+  }
+  return shaper.height <= height / scale;
+}
+
+// Find the largest scale of the font size in [min_scale, max_scale] at which a
+// paragraph fits in a box. The paragraph is shaped once and the scale found by
+// bisection on scaled layouts. The text is then shaped at the found scale to
+// verify that it fits. If it doesn't, because the layout doesn't scale exactly
+// (e.g. with bitmap fonts), the bisection is continued below that scale,
+// shaping the text at each step. Spacers keep their size when the font size is
+// scaled so paragraphs with spacers are always shaped at each step. The
+// smallest scale is returned if the text doesn't fit at any
+static double fit_paragraph_scale(HarfBuzzShaper& shaper, const ShapeInput& input,
+                                  size_t paragraph, double width, double height,
+                                  double min_scale, double max_scale) {
+  size_t first = input.paragraph_start[paragraph];
+  size_t end = input.paragraph_start[paragraph + 1];
+  bool has_spacer = std::find(input.spacer.begin() + first, input.spacer.begin() + end, true) !=
+    input.spacer.begin() + end;
+  ShapedParagraph shaped;
+
+  double scale = max_scale;
+  double low = min_scale;
+  double high = max_scale;
+  if (!has_spacer) {
+    add_paragraph(shaper, input, paragraph);
+    shaper.store_shaped_paragraph(shaped);
+    if (paragraph_fits(shaper, shaped, input, first, width, height, high)) {
+      low = high;
+    }
+    while (high - low > FIT_SCALE_TOLERANCE * low) {
+      double mid = (low + high) / 2;
+      if (paragraph_fits(shaper, shaped, input, first, width, height, mid)) {
+        low = mid;
+      } else {
+        high = mid;
+      }
+    }
+    if (low == min_scale) return low;
+    scale = low;
+  }
+
+  low = min_scale;
+  high = scale;
+  while (true) {
+    add_paragraph(shaper, input, paragraph, scale);
+    shaper.store_shaped_paragraph(shaped);
+    if (paragraph_fits(shaper, shaped, input, first, width, height, 1.0)) {
+      low = scale;
+    } else {
+      high = scale;
+    }
+    if (high - low <= FIT_SCALE_TOLERANCE * low) break;
+    scale = (low + high) / 2;
+  }
+  return low;
+}
+
+doubles fit_text_size_c(strings string, integers id, strings path, integers index,
+                        list_of<list> features, doubles size, doubles res,
+                        doubles lineheight, integers align, doubles hjust,
+                        doubles vjust, doubles width, doubles tracking,
+                        doubles indent, doubles hanging, doubles space_before,
+                        doubles space_after, integers direction, doubles height,
+                        doubles min_scale, doubles max_scale, int threads) {
+  ShapeInput input;
+  read_shape_input(string, id, path, index, features, size, res, lineheight, align,
+                   hjust, vjust, width, tracking, indent, hanging, space_before,
+                   space_after, direction, input);
+  R_xlen_t n_strings = string.size();
+  if (n_strings != height.size() ||
+      n_strings != min_scale.size() ||
+      n_strings != max_scale.size()
+  ) {
+    cpp11::stop("All input must be the same size");
+  }
+  std::vector<double> box_height(height.begin(), height.end());
+  std::vector<double> scale_min(min_scale.begin(), min_scale.end());
+  std::vector<double> scale_max(max_scale.begin(), max_scale.end());
+
+  size_t n_paragraphs = input.n_paragraphs();
+  std::vector<double> scales(n_paragraphs);
+  auto fit = [&](HarfBuzzShaper& shaper, size_t paragraph) {
+    size_t first = input.paragraph_start[paragraph];
+    scales[paragraph] = fit_paragraph_scale(shaper, input, paragraph,
+                                            input.width[first] * 64.0,
+                                            box_height[first] * 64.0,
+                                            scale_min[first], scale_max[first]);
+  };
+  size_t n_threads = n_threads_for(threads, n_paragraphs);
+  if (n_threads > 1) {
+    prepare_hb_worker_shapers(n_threads);
+    parallel_for(n_paragraphs, n_threads, [&](size_t paragraph, size_t worker) {
+      fit(get_hb_worker_shaper(worker), paragraph);
+    });
+  } else {
+    for (size_t i = 0; i < n_paragraphs; ++i) {
+      fit(get_hb_shaper(), i);
+    }
+  }
+  return writable::doubles(scales.begin(), scales.end());
+}
+
+static int string_width(HarfBuzzShaper& shaper, const char* string, FontSettings font_info,
+                        double size, double res, int include_bearing, double* width) {
+  shaper.error_code = 0;
+  int32_t width_tmp = 0;
+
+  if (include_bearing) {
+    if (!shaper.shape_single_line_width(string, font_info, size, res, width_tmp)) {
+      return shaper.error_code;
+    }
+    *width = double(width_tmp) / 64.0;
+    return 0;
+  }
+
+  // The bearings of the first and last glyph in visual order are needed so
+  // the runs have to be fully shaped and ordered, but not merged
+  const std::list<EmbedInfo>& runs = shaper.shape_single_line_runs(string, font_info, size, res);
+
+  if (shaper.error_code != 0) {
+    return shaper.error_code;
+  }
+
+  const EmbedInfo* first = nullptr;
+  const EmbedInfo* last = nullptr;
+  for (auto run = runs.begin(); run != runs.end(); ++run) {
+    if (run->glyph_id.empty()) continue;
+    for (size_t i = 0; i < run->glyph_id.size(); ++i) {
+      width_tmp += run->x_advance[i];
+    }
+    if (first == nullptr) first = &(*run);
+    last = &(*run);
+  }
+
+  if (first != nullptr) {
+    width_tmp -= first->x_bear.front();
+    width_tmp -= last->x_advance.back() - last->x_bear.back() - last->width.back();
+  }
+  *width = double(width_tmp) / 64.0;
+  return 0;
+}
+
+// A string along with the settings it is measured with. R keeps a single copy
+// of each string so strings and font paths can be compared by their CHARSXP.
+// Feature lists are usually created per string so they are compared by content
+struct StringKey {
+  SEXP string;
+  SEXP path;
+  int index;
+  size_t features;
+  double size;
+  double res;
+
+  inline bool operator==(const StringKey &other) const {
+    return string == other.string &&
+           path == other.path &&
+           index == other.index &&
+           features == other.features &&
+           size == other.size &&
+           res == other.res;
+  }
+};
+
+struct StringKeyHash {
+  size_t operator()(const StringKey & x) const {
+    return std::hash<SEXP>()(x.string) ^
+      std::hash<SEXP>()(x.path) ^
+      std::hash<int>()(x.index) ^
+      std::hash<size_t>()(x.features) ^
+      std::hash<double>()(x.size) ^
+      std::hash<double>()(x.res);
+  }
+};
+
+// Find the distinct combinations of string and settings in the input. Returns
+// the position of the first occurrence of each, and sets unique_index[i] to
+// the combination used by element i. unique_features holds the features of
+// each combination
+static std::vector<size_t> unique_strings(strings string, strings path, integers index,
+                                          list_of<list> features, doubles size,
+                                          doubles res, std::vector<size_t>& unique_index,
+                                          std::vector<std::vector<FontFeature> >& unique_features) {
+  size_t n_strings = string.size();
+  std::unordered_map<std::string, size_t> feature_ids;
+  std::vector<std::vector<FontFeature> > feature_sets;
+  std::unordered_map<StringKey, size_t, StringKeyHash> seen;
+  std::vector<size_t> unique;
+  unique_index.resize(n_strings);
+  std::string signature;
+  for (size_t i = 0; i < n_strings; ++i) {
+    std::vector<FontFeature> string_features;
+    strings tags = as_cpp<strings>(features[i][0]);
+    integers vals = as_cpp<integers>(features[i][1]);
+    signature.clear();
+    for (R_xlen_t j = 0; j < tags.size(); ++j) {
+      const char* f = Rf_translateCharUTF8(tags[j]);
+      string_features.push_back({{f[0], f[1], f[2], f[3]}, vals[j]});
+      signature.append(f, 4);
+      signature.append(reinterpret_cast<const char*>(&string_features.back().setting), sizeof(int));
+    }
+    auto feature_id = feature_ids.emplace(signature, feature_sets.size());
+    if (feature_id.second) {
+      feature_sets.push_back(std::move(string_features));
+    }
+
+    StringKey key = {string[i], path[i], index[i], feature_id.first->second, size[i], res[i]};
+    auto match = seen.emplace(key, unique.size());
+    if (match.second) {
+      unique.push_back(i);
+      unique_features.push_back(feature_sets[feature_id.first->second]);
+    }
+    unique_index[i] = match.first->second;
+  }
+  return unique;
+}
+
 doubles get_line_width_c(strings string, strings path, integers index, doubles size,
-                         doubles res, logicals include_bearing, list_of<list> features) {
+                         doubles res, logicals include_bearing, list_of<list> features,
+                         int threads) {
   int n_strings = string.size();
-  writable::doubles widths;
+  writable::doubles widths(n_strings);
   if (n_strings != 0) {
     if (n_strings != path.size() ||
         n_strings != index.size() ||
@@ -293,25 +1430,67 @@ doubles get_line_width_c(strings string, strings path, integers index, doubles s
       cpp11::stop("All input must be the same size");
     }
 
-    auto all_features = create_font_features(features);
-    auto fonts = create_font_settings(path, index, all_features);
+    // Read everything from R up front, measuring each distinct combination of
+    // string and settings only once
+    std::vector<size_t> unique_index;
+    std::vector<std::vector<FontFeature> > all_features;
+    std::vector<size_t> unique = unique_strings(string, path, index, features, size,
+                                                res, unique_index, all_features);
+    size_t n_unique = unique.size();
+    std::vector<FontSettings> fonts(n_unique);
+    std::vector<const char*> strings(n_unique);
+    std::vector<double> sizes(n_unique);
+    std::vector<double> resolutions(n_unique);
+    for (size_t u = 0; u < n_unique; ++u) {
+      size_t i = unique[u];
+      // Points into R memory that stays valid for the rest of the call
+      strings[u] = Rf_translateCharUTF8(string[i]);
+      strncpy(fonts[u].file, Rf_translateCharUTF8(path[i]), PATH_MAX);
+      fonts[u].file[PATH_MAX] = '\0';
+      fonts[u].index = index[i];
+      fonts[u].features = all_features[u].data();
+      fonts[u].n_features = all_features[u].size();
+      sizes[u] = size[i];
+      resolutions[u] = res[i];
+    }
+    int bearing = static_cast<int>(include_bearing[0]);
 
-    int error = 1;
-    double width = 0;
+    std::vector<double> unique_width(n_unique, 0.0);
+    std::vector<int> errors(n_unique, 0);
+    size_t n_threads = n_threads_for(threads, n_unique);
 
-    for (int i = 0; i < n_strings; ++i) {
-      error = ts_string_width(
-        Rf_translateCharUTF8(string[i]),
-        fonts[i],
-        size[i],
-        res[i],
-        static_cast<int>(include_bearing[0]),
-        &width
-      );
-      if (error) {
-        cpp11::stop("Failed to calculate width of string (%s) with font file (%s) with freetype error %i", Rf_translateCharUTF8(string[i]), Rf_translateCharUTF8(path[i]), error);
+    if (n_threads == 1) {
+      HarfBuzzShaper& shaper = get_hb_shaper();
+      for (size_t i = 0; i < n_unique; ++i) {
+        errors[i] = string_width(shaper, strings[i], fonts[i], sizes[i],
+                                 resolutions[i], bearing, &unique_width[i]);
+        if (errors[i]) break;
       }
-      widths.push_back(width);
+    } else {
+      size_t n_chunks = std::min(n_unique, n_threads * 8);
+      prepare_hb_worker_shapers(n_threads);
+      parallel_for(n_chunks, n_threads, [&](size_t chunk, size_t worker) {
+        HarfBuzzShaper& shaper = get_hb_worker_shaper(worker);
+        size_t from = chunk * n_unique / n_chunks;
+        size_t to = (chunk + 1) * n_unique / n_chunks;
+        for (size_t i = from; i < to; ++i) {
+          errors[i] = string_width(shaper, strings[i], fonts[i], sizes[i],
+                                   resolutions[i], bearing, &unique_width[i]);
+          if (errors[i]) break;
+        }
+      });
+    }
+
+    // Report the first failure, same as when measuring serially
+    for (size_t i = 0; i < n_unique; ++i) {
+      if (errors[i]) {
+        cpp11::stop("Failed to calculate width of string (%s) with font file (%s) with freetype error %i", strings[i], fonts[i].file, errors[i]);
+      }
+    }
+
+    double* width = REAL(widths);
+    for (int i = 0; i < n_strings; ++i) {
+      width[i] = unique_width[unique_index[i]];
     }
   }
 
@@ -320,28 +1499,134 @@ doubles get_line_width_c(strings string, strings path, integers index, doubles s
 
 int ts_string_width(const char* string, FontSettings font_info, double size,
                     double res, int include_bearing, double* width) {
+  int error = 0;
   BEGIN_CPP11
-  HarfBuzzShaper& shaper = get_hb_shaper();
+  error = string_width(get_hb_shaper(), string, font_info, size, res, include_bearing, width);
+  END_CPP11_NO_RETURN
+  return error;
+}
+
+// Shape a string and append the result to the output. Font indices refer to
+// the fallbacks added for this string
+static int append_string_shape(HarfBuzzShaper& shaper, const char* string, FontSettings font_info,
+                               double size, double res, std::vector<textshaping::Point>& loc,
+                               std::vector<uint32_t>& id, std::vector<int>* cluster,
+                               std::vector<unsigned int>& font,
+                               std::vector<FontSettings>& fallbacks,
+                               std::vector<double>& fallback_scaling) {
   shaper.error_code = 0;
   EmbedInfo string_shape = shaper.shape_single_line(string, font_info, size, res);
 
-
   if (shaper.error_code != 0) {
     return shaper.error_code;
   }
 
-  int32_t width_tmp = 0;
-  for (size_t i = 0; i < string_shape.glyph_id.size(); ++i) {
-    width_tmp += string_shape.x_advance[i];
+  size_t n_glyphs = string_shape.glyph_id.size();
+  int32_t x = 0;
+  int32_t y = 0;
+  for (size_t i = 0; i < n_glyphs; ++i) {
+    loc.push_back({
+      double(x + string_shape.x_offset[i]) / 64.0,
+      double(y + string_shape.y_offset[i]) / 64.0
+    });
+    x += string_shape.x_advance[i];
+    y += string_shape.y_advance[i];
+  }
+  id.insert(id.end(), string_shape.glyph_id.begin(), string_shape.glyph_id.end());
+  if (cluster != nullptr) {
+    cluster->insert(cluster->end(), string_shape.glyph_cluster.begin(), string_shape.glyph_cluster.end());
+  }
+  font.insert(font.end(), string_shape.font.begin(), string_shape.font.end());
+  fallbacks.insert(fallbacks.end(), string_shape.fallbacks.begin(), string_shape.fallbacks.end());
+  fallback_scaling.insert(fallback_scaling.end(), string_shape.fallback_scaling.begin(), string_shape.fallback_scaling.end());
+  return 0;
+}
+
+static int string_shape(HarfBuzzShaper& shaper, const char* string, FontSettings font_info,
+                        double size, double res, std::vector<textshaping::Point>& loc,
+                        std::vector<uint32_t>& id, std::vector<unsigned int>& font,
+                        std::vector<FontSettings>& fallbacks,
+                        std::vector<double>& fallback_scaling) {
+  loc.clear();
+  id.clear();
+  font.clear();
+  fallbacks.clear();
+  fallback_scaling.clear();
+  return append_string_shape(shaper, string, font_info, size, res, loc, id, nullptr,
+                             font, fallbacks, fallback_scaling);
+}
+
+// The order to process a batch of strings in so strings using the same font
+// follow each other
+static std::vector<size_t> batch_order(const FontSettings* font_info, const double* size, int n) {
+  std::vector<size_t> order(n);
+  std::iota(order.begin(), order.end(), 0);
+  std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+    int cmp = std::strcmp(font_info[a].file, font_info[b].file);
+    if (cmp != 0) return cmp < 0;
+    if (font_info[a].index != font_info[b].index) return font_info[a].index < font_info[b].index;
+    return size[a] < size[b];
+  });
+  return order;
+}
+
+static int string_widths(HarfBuzzShaper& shaper, const char** string, const FontSettings* font_info,
+                         const double* size, const double* res, int include_bearing, int n,
+                         double* width) {
+  std::vector<size_t> order = batch_order(font_info, size, n);
+  for (auto iter = order.begin(); iter != order.end(); ++iter) {
+    int error = string_width(shaper, string[*iter], font_info[*iter], size[*iter], res[*iter],
+                             include_bearing, width + *iter);
+    if (error != 0) return error;
   }
+  return 0;
+}
 
-  if (!include_bearing) {
-    width_tmp -= string_shape.x_bear[0];
-    width_tmp -= string_shape.x_advance.back() - string_shape.x_bear.back() - string_shape.width.back();
+static int string_shapes(HarfBuzzShaper& shaper, const char** string, const FontSettings* font_info,
+                         const double* size, const double* res, int n,
+                         std::vector<int>& glyph_offset, std::vector<textshaping::Point>& loc,
+                         std::vector<uint32_t>& id, std::vector<int>& cluster,
+                         std::vector<unsigned int>& font, std::vector<int>& fallback_offset,
+                         std::vector<FontSettings>& fallbacks,
+                         std::vector<double>& fallback_scaling) {
+  // Shape in font order into scratch buffers, recording where each string
+  // ended up, and then copy the strings to the output in input order
+  std::vector<textshaping::Point> s_loc;
+  std::vector<uint32_t> s_id;
+  std::vector<int> s_cluster;
+  std::vector<unsigned int> s_font;
+  std::vector<FontSettings> s_fallbacks;
+  std::vector<double> s_fallback_scaling;
+  std::vector<size_t> glyph_start(n + 1), glyph_end(n), fallback_start(n), fallback_end(n);
+  std::vector<size_t> order = batch_order(font_info, size, n);
+  for (auto iter = order.begin(); iter != order.end(); ++iter) {
+    glyph_start[*iter] = s_id.size();
+    fallback_start[*iter] = s_fallbacks.size();
+    int error = append_string_shape(shaper, string[*iter], font_info[*iter], size[*iter], res[*iter],
+                                    s_loc, s_id, &s_cluster, s_font, s_fallbacks, s_fallback_scaling);
+    if (error != 0) return error;
+    glyph_end[*iter] = s_id.size();
+    fallback_end[*iter] = s_fallbacks.size();
   }
-  *width = double(width_tmp) / 64.0;
 
-  END_CPP11_NO_RETURN
+  glyph_offset.assign(1, 0);
+  fallback_offset.assign(1, 0);
+  loc.clear();
+  id.clear();
+  cluster.clear();
+  font.clear();
+  fallbacks.clear();
+  fallback_scaling.clear();
+  for (int i = 0; i < n; ++i) {
+    loc.insert(loc.end(), s_loc.begin() + glyph_start[i], s_loc.begin() + glyph_end[i]);
+    id.insert(id.end(), s_id.begin() + glyph_start[i], s_id.begin() + glyph_end[i]);
+    cluster.insert(cluster.end(), s_cluster.begin() + glyph_start[i], s_cluster.begin() + glyph_end[i]);
+    font.insert(font.end(), s_font.begin() + glyph_start[i], s_font.begin() + glyph_end[i]);
+    fallbacks.insert(fallbacks.end(), s_fallbacks.begin() + fallback_start[i], s_fallbacks.begin() + fallback_end[i]);
+    fallback_scaling.insert(fallback_scaling.end(), s_fallback_scaling.begin() + fallback_start[i], s_fallback_scaling.begin() + fallback_end[i]);
+    glyph_offset.push_back(id.size());
+    fallback_offset.push_back(fallbacks.size());
+  }
   return 0;
 }
 
@@ -350,39 +1635,318 @@ int ts_string_shape(const char* string, FontSettings font_info, double size,
                     std::vector<int>& cluster, std::vector<unsigned int>& font,
                     std::vector<FontSettings>& fallbacks,
                     std::vector<double>& fallback_scaling) {
+  int error = 0;
   BEGIN_CPP11
-  HarfBuzzShaper& shaper = get_hb_shaper();
+  error = string_shape(get_hb_shaper(), string, font_info, size, res, loc, id, font,
+                       fallbacks, fallback_scaling);
+  END_CPP11_NO_RETURN
+  return error;
+}
+
+// Buffers reused between calls so the allocation free API doesn't allocate once
+// they have grown large enough
+struct GlyphScratch {
+  std::vector<textshaping::Point> loc;
+  std::vector<uint32_t> id;
+};
+
+// Shape a string and call visit(id, loc, n, font, font_offset, run) for every
+// run of glyphs sharing a font, in visual order. font is the index of the font
+// among the fallbacks of the embedding run, and font_offset the number of
+// fallbacks in the preceding embeddings that have glyphs
+template<typename Visit>
+static int visit_string_shape(HarfBuzzShaper& shaper, const char* string, FontSettings font_info,
+                              double size, double res, GlyphScratch& scratch, Visit visit) {
   shaper.error_code = 0;
-  EmbedInfo string_shape = shaper.shape_single_line(string, font_info, size, res);
+  const std::list<EmbedInfo>& runs = shaper.shape_single_line_runs(string, font_info, size, res);
 
   if (shaper.error_code != 0) {
     return shaper.error_code;
   }
 
-  size_t n_glyphs = string_shape.glyph_id.size();
-  loc.clear();
-  id.clear();
-  font.clear();
-  fallbacks.clear();
-  fallback_scaling.clear();
   int32_t x = 0;
   int32_t y = 0;
-  for (size_t i = 0; i < n_glyphs; ++i) {
-    loc.push_back({
-      double(x + string_shape.x_offset[i]) / 64.0,
-      double(y + string_shape.y_offset[i]) / 64.0
-    });
-    x += string_shape.x_advance[i];
-    y += string_shape.y_advance[i];
+  unsigned int font_offset = 0;
+  for (auto run = runs.begin(); run != runs.end(); ++run) {
+    size_t n_glyphs = run->glyph_id.size();
+    if (n_glyphs == 0) continue;
+    if (scratch.loc.size() < n_glyphs) {
+      scratch.loc.resize(n_glyphs);
+      scratch.id.resize(n_glyphs);
+    }
+    for (size_t i = 0; i < n_glyphs; ++i) {
+      scratch.id[i] = run->glyph_id[i];
+      scratch.loc[i] = {
+        double(x + run->x_offset[i]) / 64.0,
+        double(y + run->y_offset[i]) / 64.0
+      };
+      x += run->x_advance[i];
+      y += run->y_advance[i];
+    }
+    size_t start = 0;
+    for (size_t i = 1; i <= n_glyphs; ++i) {
+      if (i == n_glyphs || run->font[i] != run->font[start]) {
+        visit(scratch.id.data() + start, scratch.loc.data() + start, i - start,
+              run->font[start], font_offset, *run);
+        start = i;
+      }
+    }
+    font_offset += run->fallbacks.size();
+  }
+  return 0;
+}
+
+// Contexts own a shaper with its own FreeType library so they don't share any
+// mutable state with the global shaper or each other. The shape and bidi caches
+// are shared but safe to use from multiple threads
+struct textshaping::ShaperContext {
+  HarfBuzzShaper shaper;
+  GlyphScratch scratch;
+
+  ShaperContext() : shaper(true), scratch() {}
+};
+
+// Fallback font and emoji lookups go through systemfonts which may only be
+// called on the main thread. While a context is used on another thread these
+// calls are queued here and wait until the main thread runs them with
+// ts_context_serve()
+static MainThreadQueue context_queue;
+
+class ContextThread {
+public:
+  ContextThread() : attached(!on_main_thread()) {
+    if (attached) context_queue.attach();
+  }
+  ~ContextThread() {
+    if (attached) context_queue.detach();
   }
-  id.assign(string_shape.glyph_id.begin(), string_shape.glyph_id.end());
-  font.assign(string_shape.font.begin(), string_shape.font.end());
-  fallbacks.assign(string_shape.fallbacks.begin(), string_shape.fallbacks.end());
-  fallback_scaling.assign(string_shape.fallback_scaling.begin(), string_shape.fallback_scaling.end());
 
+private:
+  bool attached;
+};
+
+textshaping::ShaperContext* ts_context_create() {
+  try {
+    return new textshaping::ShaperContext();
+  } catch (...) {
+    return nullptr;
+  }
+}
+
+void ts_context_destroy(textshaping::ShaperContext* context) {
+  delete context;
+}
+
+// The context functions may be called off the main thread so errors are
+// returned as codes rather than raised as R errors
+static const int CONTEXT_ERROR = -1;
+
+int ts_context_serve() {
+  if (!on_main_thread()) return CONTEXT_ERROR;
+  context_queue.serve();
+  return 0;
+}
+
+int ts_context_string_width(textshaping::ShaperContext* context, const char* string,
+                            FontSettings font_info, double size, double res,
+                            int include_bearing, double* width) {
+  if (context == nullptr) return CONTEXT_ERROR;
+  try {
+    ContextThread thread;
+    return string_width(context->shaper, string, font_info, size, res, include_bearing, width);
+  } catch (...) {
+    return CONTEXT_ERROR;
+  }
+}
+
+int ts_context_string_shape(textshaping::ShaperContext* context, const char* string,
+                            FontSettings font_info, double size, double res,
+                            std::vector<textshaping::Point>& loc, std::vector<uint32_t>& id,
+                            std::vector<int>& cluster, std::vector<unsigned int>& font,
+                            std::vector<FontSettings>& fallbacks,
+                            std::vector<double>& fallback_scaling) {
+  if (context == nullptr) return CONTEXT_ERROR;
+  try {
+    ContextThread thread;
+    return string_shape(context->shaper, string, font_info, size, res, loc, id, font,
+                        fallbacks, fallback_scaling);
+  } catch (...) {
+    return CONTEXT_ERROR;
+  }
+}
+
+// Batched versions. Without a context the global shaper is used and they must
+// be called on the main thread
+int ts_string_widths(textshaping::ShaperContext* context, const char** string,
+                     const FontSettings* font_info, const double* size, const double* res,
+                     int include_bearing, int n, double* width) {
+  if (context != nullptr) {
+    try {
+      ContextThread thread;
+      return string_widths(context->shaper, string, font_info, size, res, include_bearing, n, width);
+    } catch (...) {
+      return CONTEXT_ERROR;
+    }
+  }
+  int error = 0;
+  BEGIN_CPP11
+  error = string_widths(get_hb_shaper(), string, font_info, size, res, include_bearing, n, width);
+  END_CPP11_NO_RETURN
+  return error;
+}
+
+int ts_string_shapes(textshaping::ShaperContext* context, const char** string,
+                     const FontSettings* font_info, const double* size, const double* res,
+                     int n, std::vector<int>& glyph_offset, std::vector<textshaping::Point>& loc,
+                     std::vector<uint32_t>& id, std::vector<int>& cluster,
+                     std::vector<unsigned int>& font, std::vector<int>& fallback_offset,
+                     std::vector<FontSettings>& fallbacks,
+                     std::vector<double>& fallback_scaling) {
+  if (context != nullptr) {
+    try {
+      ContextThread thread;
+      return string_shapes(context->shaper, string, font_info, size, res, n, glyph_offset,
+                           loc, id, cluster, font, fallback_offset, fallbacks, fallback_scaling);
+    } catch (...) {
+      return CONTEXT_ERROR;
+    }
+  }
+  int error = 0;
+  BEGIN_CPP11
+  error = string_shapes(get_hb_shaper(), string, font_info, size, res, n, glyph_offset,
+                        loc, id, cluster, font, fallback_offset, fallbacks, fallback_scaling);
+  END_CPP11_NO_RETURN
+  return error;
+}
+
+// Allocation free versions writing into caller owned buffers or passing each
+// glyph run to a callback. Without a context they must be called on the main
+// thread
+static int string_shape_buffer(HarfBuzzShaper& shaper, GlyphScratch& scratch,
+                               const char* string, FontSettings font_info, double size,
+                               double res, unsigned int capacity, textshaping::Point* loc,
+                               uint32_t* id, unsigned int* font, unsigned int* n_glyphs,
+                               unsigned int fallback_capacity, FontSettings* fallbacks,
+                               double* fallback_scaling, unsigned int* n_fallbacks) {
+  unsigned int n = 0;
+  unsigned int n_fonts = 0;
+  const EmbedInfo* last_run = nullptr;
+  int error = visit_string_shape(shaper, string, font_info, size, res, scratch,
+    [&](const uint32_t* run_id, const textshaping::Point* run_loc, size_t run_n,
+        unsigned int run_font, unsigned int font_offset, const EmbedInfo& run) {
+      for (size_t i = 0; i < run_n && n + i < capacity; ++i) {
+        loc[n + i] = run_loc[i];
+        id[n + i] = run_id[i];
+        font[n + i] = font_offset + run_font;
+      }
+      n += run_n;
+      if (&run != last_run) {
+        for (size_t i = 0; i < run.fallbacks.size() && n_fonts + i < fallback_capacity; ++i) {
+          fallbacks[n_fonts + i] = run.fallbacks[i];
+          fallback_scaling[n_fonts + i] = run.fallback_scaling[i];
+        }
+        n_fonts += run.fallbacks.size();
+        last_run = &run;
+      }
+    }
+  );
+  *n_glyphs = n;
+  *n_fallbacks = n_fonts;
+  return error;
+}
+
+static int string_shape_visit(HarfBuzzShaper& shaper, GlyphScratch& scratch,
+                              const char* string, FontSettings font_info, double size,
+                              double res, textshaping::GlyphRunVisitor visitor, void* data) {
+  return visit_string_shape(shaper, string, font_info, size, res, scratch,
+    [&](const uint32_t* run_id, const textshaping::Point* run_loc, size_t run_n,
+        unsigned int run_font, unsigned int font_offset, const EmbedInfo& run) {
+      visitor(run_id, run_loc, run_n, &run.fallbacks[run_font], run.fallback_scaling[run_font], data);
+    }
+  );
+}
+
+int ts_string_shape_buffer(textshaping::ShaperContext* context, const char* string,
+                           FontSettings font_info, double size, double res,
+                           unsigned int capacity, textshaping::Point* loc, uint32_t* id,
+                           unsigned int* font, unsigned int* n_glyphs,
+                           unsigned int fallback_capacity, FontSettings* fallbacks,
+                           double* fallback_scaling, unsigned int* n_fallbacks) {
+  if (context != nullptr) {
+    try {
+      ContextThread thread;
+      return string_shape_buffer(context->shaper, context->scratch, string, font_info, size, res,
+                                 capacity, loc, id, font, n_glyphs, fallback_capacity,
+                                 fallbacks, fallback_scaling, n_fallbacks);
+    } catch (...) {
+      return CONTEXT_ERROR;
+    }
+  }
+  static GlyphScratch scratch;
+  int error = 0;
+  BEGIN_CPP11
+  error = string_shape_buffer(get_hb_shaper(), scratch, string, font_info, size, res,
+                              capacity, loc, id, font, n_glyphs, fallback_capacity,
+                              fallbacks, fallback_scaling, n_fallbacks);
   END_CPP11_NO_RETURN
+  return error;
+}
+
+int ts_string_shape_visit(textshaping::ShaperContext* context, const char* string,
+                          FontSettings font_info, double size, double res,
+                          textshaping::GlyphRunVisitor visitor, void* data) {
+  if (context != nullptr) {
+    try {
+      ContextThread thread;
+      return string_shape_visit(context->shaper, context->scratch, string, font_info, size, res,
+                                visitor, data);
+    } catch (...) {
+      return CONTEXT_ERROR;
+    }
+  }
+  static GlyphScratch scratch;
+  int error = 0;
+  BEGIN_CPP11
+  error = string_shape_visit(get_hb_shaper(), scratch, string, font_info, size, res,
+                             visitor, data);
+  END_CPP11_NO_RETURN
+  return error;
+}
+
+static int glyph_metrics(HarfBuzzShaper& shaper, uint32_t codepoint, FontSettings font_info,
+                         double size, double res, double* ascent, double* descent,
+                         double* width) {
+  shaper.error_code = 0;
+  GlyphMetrics metrics;
+  if (!shaper.glyph_metrics(codepoint, font_info, size, res, metrics)) {
+    return shaper.error_code;
+  }
+  *ascent = metrics.ascent;
+  *descent = metrics.descent;
+  *width = metrics.width;
   return 0;
 }
+
+// Metrics of a single character. Results are cached per font, size and
+// character so repeated lookups don't need to touch the font
+int ts_glyph_metrics(textshaping::ShaperContext* context, uint32_t codepoint,
+                     FontSettings font_info, double size, double res, double* ascent,
+                     double* descent, double* width) {
+  if (context != nullptr) {
+    try {
+      ContextThread thread;
+      return glyph_metrics(context->shaper, codepoint, font_info, size, res, ascent, descent, width);
+    } catch (...) {
+      return CONTEXT_ERROR;
+    }
+  }
+  int error = 0;
+  BEGIN_CPP11
+  error = glyph_metrics(get_hb_shaper(), codepoint, font_info, size, res, ascent, descent, width);
+  END_CPP11_NO_RETURN
+  return error;
+}
+
 int ts_string_shape_old(const char* string, FontSettings font_info, double size,
                         double res, double* x, double* y, int* id, int* n_glyphs,
                         unsigned int max_length) {
@@ -419,4 +1983,14 @@ void export_string_metrics(DllInfo* dll) {
   R_RegisterCCallable("textshaping", "ts_string_width", (DL_FUNC)ts_string_width);
   R_RegisterCCallable("textshaping", "ts_string_shape_new", (DL_FUNC)ts_string_shape);
   R_RegisterCCallable("textshaping", "ts_string_shape", (DL_FUNC)ts_string_shape_old);
+  R_RegisterCCallable("textshaping", "ts_context_create", (DL_FUNC)ts_context_create);
+  R_RegisterCCallable("textshaping", "ts_context_destroy", (DL_FUNC)ts_context_destroy);
+  R_RegisterCCallable("textshaping", "ts_context_serve", (DL_FUNC)ts_context_serve);
+  R_RegisterCCallable("textshaping", "ts_context_string_width", (DL_FUNC)ts_context_string_width);
+  R_RegisterCCallable("textshaping", "ts_context_string_shape", (DL_FUNC)ts_context_string_shape);
+  R_RegisterCCallable("textshaping", "ts_string_widths", (DL_FUNC)ts_string_widths);
+  R_RegisterCCallable("textshaping", "ts_string_shapes", (DL_FUNC)ts_string_shapes);
+  R_RegisterCCallable("textshaping", "ts_string_shape_buffer", (DL_FUNC)ts_string_shape_buffer);
+  R_RegisterCCallable("textshaping", "ts_string_shape_visit", (DL_FUNC)ts_string_shape_visit);
+  R_RegisterCCallable("textshaping", "ts_glyph_metrics", (DL_FUNC)ts_glyph_metrics);
 }
@@ -8,6 +8,7 @@
 #include <cpp11/list.hpp>
 #include <cpp11/list_of.hpp>
 #include <cpp11/logicals.hpp>
+#include <cpp11/sexp.hpp>
 
 #include <systemfonts.h>
 #include <vector>
@@ -19,6 +20,10 @@ struct Point {
   double x;
   double y;
 };
+struct ShaperContext;
+typedef void (*GlyphRunVisitor)(const uint32_t* id, const Point* loc,
+                                unsigned int n_glyphs, const FontSettings* font,
+                                double scaling, void* data);
 }
 
 [[cpp11::register]]
@@ -28,11 +33,67 @@ list get_string_shape_c(strings string, integers id, strings path, integers inde
                         doubles vjust, doubles width, doubles tracking,
                         doubles indent, doubles hanging, doubles space_before,
                         doubles space_after, integers direction,
-                        list_of<integers> soft_wrap, list_of<integers> hard_wrap);
+                        bool metrics_only, int threads);
+
+[[cpp11::register]]
+list get_string_shape_arrow_c(strings string, integers id, strings path, integers index,
+                              list_of<list> features, doubles size, doubles res,
+                              doubles lineheight, integers align, doubles hjust,
+                              doubles vjust, doubles width, doubles tracking,
+                              doubles indent, doubles hanging, doubles space_before,
+                              doubles space_after, integers direction,
+                              integers order, int threads);
+
+[[cpp11::register]]
+doubles get_shape_timings_c();
+
+[[cpp11::register]]
+sexp shape_text_async_c(strings string, integers id, strings path, integers index,
+                        list_of<list> features, doubles size, doubles res,
+                        doubles lineheight, integers align, doubles hjust,
+                        doubles vjust, doubles width, doubles tracking,
+                        doubles indent, doubles hanging, doubles space_before,
+                        doubles space_after, integers direction,
+                        bool metrics_only, int threads);
+
+[[cpp11::register]]
+bool shape_job_done_c(sexp job);
+
+[[cpp11::register]]
+list shape_job_collect_c(sexp job);
+
+[[cpp11::register]]
+sexp shape_text_prepare_c(strings string, integers id, strings path, integers index,
+                          list_of<list> features, doubles size, doubles res,
+                          doubles lineheight, integers align, doubles hjust,
+                          doubles vjust, doubles width, doubles tracking,
+                          doubles indent, doubles hanging, doubles space_before,
+                          doubles space_after, integers direction, int threads);
+
+[[cpp11::register]]
+list shape_text_layout_c(sexp text, doubles lineheight, integers align,
+                         doubles hjust, doubles vjust, doubles width,
+                         doubles indent, doubles hanging, doubles space_before,
+                         doubles space_after, list_of<doubles> line_width,
+                         list_of<doubles> line_offset, bool metrics_only);
+
+[[cpp11::register]]
+doubles shape_text_wrap_width_c(sexp text, integers n_lines, doubles width,
+                                doubles indent, doubles hanging);
+
+[[cpp11::register]]
+doubles fit_text_size_c(strings string, integers id, strings path, integers index,
+                        list_of<list> features, doubles size, doubles res,
+                        doubles lineheight, integers align, doubles hjust,
+                        doubles vjust, doubles width, doubles tracking,
+                        doubles indent, doubles hanging, doubles space_before,
+                        doubles space_after, integers direction, doubles height,
+                        doubles min_scale, doubles max_scale, int threads);
 
 [[cpp11::register]]
 doubles get_line_width_c(strings string, strings path, integers index, doubles size,
-                         doubles res, logicals include_bearing, list_of<list> features);
+                         doubles res, logicals include_bearing, list_of<list> features,
+                         int threads);
 [[cpp11::register]]
 bool get_systemfont_cache_compat();
 int ts_string_width(const char* string, FontSettings font_info,
@@ -42,6 +103,40 @@ int ts_string_shape(const char* string, FontSettings font_info, double size,
                     std::vector<int>& cluster, std::vector<unsigned int>& font,
                     std::vector<FontSettings>& fallbacks,
                     std::vector<double>& fallback_scaling);
+textshaping::ShaperContext* ts_context_create();
+void ts_context_destroy(textshaping::ShaperContext* context);
+int ts_context_serve();
+int ts_context_string_width(textshaping::ShaperContext* context, const char* string,
+                            FontSettings font_info, double size, double res,
+                            int include_bearing, double* width);
+int ts_context_string_shape(textshaping::ShaperContext* context, const char* string,
+                            FontSettings font_info, double size, double res,
+                            std::vector<textshaping::Point>& loc, std::vector<uint32_t>& id,
+                            std::vector<int>& cluster, std::vector<unsigned int>& font,
+                            std::vector<FontSettings>& fallbacks,
+                            std::vector<double>& fallback_scaling);
+int ts_string_widths(textshaping::ShaperContext* context, const char** string,
+                     const FontSettings* font_info, const double* size, const double* res,
+                     int include_bearing, int n, double* width);
+int ts_string_shapes(textshaping::ShaperContext* context, const char** string,
+                     const FontSettings* font_info, const double* size, const double* res,
+                     int n, std::vector<int>& glyph_offset, std::vector<textshaping::Point>& loc,
+                     std::vector<uint32_t>& id, std::vector<int>& cluster,
+                     std::vector<unsigned int>& font, std::vector<int>& fallback_offset,
+                     std::vector<FontSettings>& fallbacks,
+                     std::vector<double>& fallback_scaling);
+int ts_string_shape_buffer(textshaping::ShaperContext* context, const char* string,
+                           FontSettings font_info, double size, double res,
+                           unsigned int capacity, textshaping::Point* loc, uint32_t* id,
+                           unsigned int* font, unsigned int* n_glyphs,
+                           unsigned int fallback_capacity, FontSettings* fallbacks,
+                           double* fallback_scaling, unsigned int* n_fallbacks);
+int ts_string_shape_visit(textshaping::ShaperContext* context, const char* string,
+                          FontSettings font_info, double size, double res,
+                          textshaping::GlyphRunVisitor visitor, void* data);
+int ts_glyph_metrics(textshaping::ShaperContext* context, uint32_t codepoint,
+                     FontSettings font_info, double size, double res, double* ascent,
+                     double* descent, double* width);
 int ts_string_shape_old(const char* string, FontSettings font_info, double size,
                         double res, double* x, double* y, int* id, int* n_glyphs,
                         unsigned int max_length);
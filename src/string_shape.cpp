@@ -7,27 +7,33 @@
 #include <vector>
 
 #include <hb-ft.h>
+#include <hb-ot.h>
+#include FT_TRUETYPE_TABLES_H
+#include FT_ADVANCES_H
 #include "string_shape.h"
 #include "string_bidi.h"
 #include <systemfonts.h>
 #include <systemfonts-ft.h>
 #include <algorithm>
+#include "thread_pool.h"
+#include "hb_shaper.h"
 
-UTF_UCS HarfBuzzShaper::utf_converter = UTF_UCS();
-LRU_Cache<BidiID, std::vector<int> > HarfBuzzShaper::bidi_cache = {1000};
-LRU_Cache<ShapeID, ShapeInfo> HarfBuzzShaper::shape_cache = {1000};
+// The caches are shared by all shapers, including those on worker threads
+Concurrent_Cache<BidiID, std::vector<int> > HarfBuzzShaper::bidi_cache = {1024};
+Concurrent_Cache<ShapeID, ShapeInfo> HarfBuzzShaper::shape_cache = {1024};
+Concurrent_Cache<GlyphMetricID, GlyphMetrics> HarfBuzzShaper::metric_cache = {4096};
+Concurrent_Cache<FaceID, SimpleFont> HarfBuzzShaper::simple_font_cache = {256};
 
-FT_Face get_cached_or_new_face(const char* fontfile, int index, double size, double res, int* error) {
-  if (ft_compat) {
-    return get_cached_face(fontfile, index, size, res, error);
-  }
-  FT_Face new_face;
-  FT_Error err = FT_New_Face(ft.library, fontfile, index, &new_face);
+static const size_t FACE_CACHE_SIZE = 64;
+
+static FT_Face new_sized_face(FT_Library library, const char* fontfile, int index, double size, double res, int* error) {
+  FT_Face new_face = NULL;
+  FT_Error err = FT_New_Face(library, fontfile, index, &new_face);
   if (err != 0) {
-    err = FT_New_Face(ft.library, fontfile, 0, &new_face);
+    err = FT_New_Face(library, fontfile, 0, &new_face);
     if (err != 0) {
       *error = err;
-      return new_face;
+      return NULL;
     }
   }
 
@@ -36,12 +42,13 @@ FT_Face get_cached_or_new_face(const char* fontfile, int index, double size, dou
     if (err != 0) {
       *error = err;
       FT_Done_Face(new_face);
+      return NULL;
     }
   } else {
     if (new_face->num_fixed_sizes == 0) {
       *error = 23;
       FT_Done_Face(new_face);
-      return new_face;
+      return NULL;
     }
     int best_match = 0;
     int diff = 1e6;
@@ -68,18 +75,29 @@ FT_Face get_cached_or_new_face(const char* fontfile, int index, double size, dou
     if (err != 0) {
       *error = err;
       FT_Done_Face(new_face);
+      return NULL;
     }
   }
   return new_face;
 }
 
+FT_Face get_cached_or_new_face(const char* fontfile, int index, double size, double res, int* error) {
+  if (ft_compat) {
+    // The face cache lives in systemfonts so it is guarded like other calls
+    FT_Face face = NULL;
+    run_serialised([&]() {
+      face = get_cached_face(fontfile, index, size, res, error);
+    });
+    return face;
+  }
+  return new_sized_face(ft.library, fontfile, index, size, res, error);
+}
+
 bool HarfBuzzShaper::shape_string(const char* string, FontSettings& font_info,
                                   double size, double res, double lineheight,
                                   int align, double hjust, double vjust, double width,
                                   double tracking, double ind, double hang, double before,
-                                  double after, bool spacer, int direction,
-                                  std::vector<int>& soft_wrap,
-                                  std::vector<int>& hard_wrap) {
+                                  double after, bool spacer, int direction) {
   reset();
 
   // Set global settings
@@ -97,13 +115,11 @@ bool HarfBuzzShaper::shape_string(const char* string, FontSettings& font_info,
 
   dir = direction;
 
-  return add_string(string, font_info, size, tracking, spacer, soft_wrap, hard_wrap);
+  return add_string(string, font_info, size, tracking, spacer);
 }
 
 bool HarfBuzzShaper::add_string(const char* string, FontSettings& font_info,
-                                double size, double tracking, bool spacer,
-                                std::vector<int>& soft_wrap,
-                                std::vector<int>& hard_wrap) {
+                                double size, double tracking, bool spacer) {
   if (spacer) {
     return add_spacer(font_info, size, tracking);
   }
@@ -112,7 +128,7 @@ bool HarfBuzzShaper::add_string(const char* string, FontSettings& font_info,
 
   // Convert string to UTC and add it to the global string
   int n_chars = 0;
-  const uint32_t* utc_string = utf_converter.convert_to_ucs(string, n_chars);
+  const uint32_t* utc_string = utf_converter.convert_to_ucs(string, n_chars, text_info);
 
   if (n_chars == 0) {
     // Empty run - we treat is as a 0-width spacer to capture the font ascend and descend
@@ -125,13 +141,9 @@ bool HarfBuzzShaper::add_string(const char* string, FontSettings& font_info,
 
   unsigned int index = shape_infos.size();
 
-  // Add precalculated soft and hard break points to the sets
-  for (auto iter = soft_wrap.begin(); iter != soft_wrap.end(); ++iter) {
-    soft_break.insert(run_start + (*iter) - 1);
-  }
-  for (auto iter = hard_wrap.begin(); iter != hard_wrap.end(); ++iter) {
-    hard_break.insert(run_start + (*iter) - 1);
-  }
+  // Find the break opportunities of the run. Each string is broken on its own
+  // so the end of a run is always a possible break point
+  find_line_breaks(utc_string, n_chars, soft_break, hard_break);
 
   // Add run info to list
   shape_infos.emplace_back(run_start, run_end, font_info, index, size, cur_res, tracking);
@@ -146,9 +158,9 @@ bool HarfBuzzShaper::add_spacer(FontSettings& font_info, double height, double w
 #if HB_VERSION_MAJOR < 2 && HB_VERSION_MINOR < 2
 #else
   int error = 0;
-  FT_Face face = get_cached_or_new_face(font_info.file, font_info.index, height, cur_res, &error);
+  FT_Face face = get_face(font_info.file, font_info.index, height, cur_res, &error);
   if (error != 0) {
-    Rprintf("Failed to get face: %s, %i\n", font_info.file, font_info.index);
+    report_face_error(font_info);
     error_code = error;
   } else {
     hb_font_t *font = hb_ft_font_create_referenced(face);
@@ -197,32 +209,81 @@ bool HarfBuzzShaper::add_spacer(FontSettings& font_info, double height, double w
   return true;
 }
 
-bool HarfBuzzShaper::finish_string() {
+bool HarfBuzzShaper::finish_string(bool metrics_only, size_t n_threads) {
+  if (shape_infos.empty()) {
+    return true;
+  }
+
+  // Shape the text and break it into lines before placing the lines
+  std::vector<LayoutLine> lines;
+  if (!break_lines_parallel(n_threads, lines)) {
+    auto final_embeddings = combine_embeddings(shape_infos, dir);
+    break_lines(final_embeddings, lines);
+  }
+  return layout_lines(lines, metrics_only);
+}
+
+void HarfBuzzShaper::store_shaped_paragraph(ShapedParagraph& paragraph) {
+  paragraph.embeddings = combine_embeddings(shape_infos, dir);
+  store_paragraph(paragraph.state);
+}
+
+bool HarfBuzzShaper::layout_paragraph(const ShapedParagraph& paragraph,
+                                      double lineheight, int align, double hjust,
+                                      double vjust, double width, double ind,
+                                      double hang, double before, double after,
+                                      bool metrics_only,
+                                      const std::vector<int32_t>& box_width,
+                                      const std::vector<int32_t>& box_offset) {
+  ParagraphState state = paragraph.state;
+  load_paragraph(state);
+
+  max_width = width + 1; // To prevent rounding errors
+  line_box_width = box_width;
+  line_box_offset = box_offset;
+  indent = ind;
+  hanging = hang;
+  space_before = before;
+  space_after = after;
+
+  cur_lineheight = lineheight;
+  cur_align = align;
+  cur_hjust = hjust;
+  cur_vjust = vjust;
+
   if (shape_infos.empty()) {
     return true;
   }
 
+  // Line breaking consumes the embeddings so it works on a copy
+  std::list<EmbedInfo> embeddings = paragraph.embeddings;
+  std::vector<LayoutLine> lines;
+  break_lines(embeddings, lines);
+  return layout_lines(lines, metrics_only);
+}
+
+bool HarfBuzzShaper::layout_lines(std::vector<LayoutLine>& lines, bool metrics_only) {
   pen_x = 0;
   pen_y = -space_before;
   int32_t cur_line_indent = indent;
   int32_t previous_line_descend = 0;
   int32_t line_ascend = 0;
   bool hard_break = false;
-  uint32_t break_char;
   int32_t line_left_extra = 0;
-  std::list<EmbedInfo> line;
+  size_t n_glyphs = 0;
 
-  auto final_embeddings = combine_embeddings(shape_infos, dir);
   bool ltr = dir != 2;
   // If alignment depends on direction update the alignment now
   if (cur_align == 7) cur_align = ltr ? 0 : 2;
   if (cur_align == 8) cur_align = ltr ? 3 : 5;
 
   // Lay out one line at a time
-  while (!final_embeddings.empty()) {
-    // Retrieve the next line from the embedding list
-    line = get_next_line_at_width(max_width - cur_line_indent, final_embeddings, hard_break, break_char);
+  for (size_t l = 0; l < lines.size(); ++l) {
+    std::list<EmbedInfo>& line = lines[l].embeddings;
+    hard_break = lines[l].hard_break;
+    bool last_line = l == lines.size() - 1;
     bool first_char = true;
+    bool last_may_stretch = false;
 
     // If ltr indent goes to the left
     if (ltr) pen_x += cur_line_indent;
@@ -232,6 +293,9 @@ bool HarfBuzzShaper::finish_string() {
     line_left_bear.push_back(0);
     line_right_bear.push_back(0);
     line_must_break.push_back(hard_break);
+    line_n_glyphs.push_back(0);
+    line_n_stretch.push_back(0);
+    line_n_may_stretch.push_back(0);
     size_t line_start_index = x_pos.size();
     line_left_extra = 0;
 
@@ -251,20 +315,30 @@ bool HarfBuzzShaper::finish_string() {
           }
         }
         if (iter->glyph_id[i] != EMPTY_CHAR) { // Avoid adding made up glyph info for empty text runs
-          glyph_id.push_back(iter->glyph_id[i]);
-          glyph_cluster.push_back(iter->glyph_cluster[i]);
-          fontfile.push_back(iter->fallbacks[iter->font[i]].file);
-          fontindex.push_back(iter->fallbacks[iter->font[i]].index);
-          fontsize.push_back(iter->fallback_size[iter->font[i]]);
-          advance.push_back(iter->x_advance[i]);
-          ascender.push_back(iter->ascenders[i]);
-          descender.push_back(iter->descenders[i]);
-
-          string_id.push_back(iter->string_id[i]);
-          line_id.push_back(line_width.size() - 1);
-          x_pos.push_back(pen_x + iter->x_offset[i]);
-
-          may_stretch.push_back(iter->may_stretch[i]);
+          if (!metrics_only) {
+            glyph_id.push_back(iter->glyph_id[i]);
+            glyph_cluster.push_back(iter->glyph_cluster[i]);
+            fontfile.push_back(iter->fallbacks[iter->font[i]].file);
+            fontindex.push_back(iter->fallbacks[iter->font[i]].index);
+            fontsize.push_back(iter->fallback_size[iter->font[i]]);
+            advance.push_back(iter->x_advance[i]);
+            ascender.push_back(iter->ascenders[i]);
+            descender.push_back(iter->descenders[i]);
+
+            string_id.push_back(iter->string_id[i]);
+            line_id.push_back(line_width.size() - 1);
+            x_pos.push_back(pen_x + iter->x_offset[i]);
+
+            may_stretch.push_back(iter->may_stretch[i]);
+          }
+
+          // The very first glyph and the last glyph on each line never count
+          // towards the stretches used for justification
+          last_may_stretch = iter->may_stretch[i] && n_glyphs != 0;
+          if (iter->may_stretch[i]) line_n_may_stretch.back()++;
+          if (last_may_stretch) line_n_stretch.back()++;
+          line_n_glyphs.back()++;
+          n_glyphs++;
         }
 
 
@@ -275,7 +349,7 @@ bool HarfBuzzShaper::finish_string() {
           top_bearing = std::max(top_bearing, iter->y_bear[i]);
         }
         // Only needed for last line
-        if (final_embeddings.empty()) {
+        if (last_line) {
           bottom_bearing = std::min(bottom_bearing, iter->height[i] + iter->y_bear[i]);
         }
 
@@ -297,12 +371,14 @@ bool HarfBuzzShaper::finish_string() {
         if (!iter->is_blank[i]) first_char = false;
       }
     }
+    if (last_may_stretch) line_n_stretch.back()--;
+
     // We now know the height of the line. Update pen_y and record y_pos
     // Also update max_descend for next line to use
     pen_y -= (line_ascend - previous_line_descend) * (line_width.size() == 1 ? 1 : cur_lineheight);
     for (auto iter = line.begin(); iter != line.end(); ++iter) {
       for (size_t i = 0; i < iter->glyph_id.size(); ++i) {
-        if (iter->glyph_id[i] != EMPTY_CHAR) { // Avoid adding made up glyph info for empty text runs
+        if (!metrics_only && iter->glyph_id[i] != EMPTY_CHAR) { // Avoid adding made up glyph info for empty text runs
           y_pos.push_back(pen_y + iter->y_offset[i]);
         }
         previous_line_descend = std::min(previous_line_descend, iter->descenders[i]);
@@ -318,7 +394,7 @@ bool HarfBuzzShaper::finish_string() {
     }
 
     // Reset pen to next line
-    if (!final_embeddings.empty() || hard_break) {
+    if (!last_line || hard_break) {
       cur_line_indent = hard_break ? indent : hanging;
       pen_x = 0;
       line_ascend = 0;
@@ -328,13 +404,17 @@ bool HarfBuzzShaper::finish_string() {
 
   if (hard_break) {
     // Last line ended with a line break. We move pen_y down based on last glyph size
-    size_t last_glyph = line.back().embedding_level % 2 == 0 ? line.back().glyph_id.size() : 0;
-    int32_t line_height = (line.back().ascenders[last_glyph] - line.back().descenders[last_glyph]) * cur_lineheight;
+    EmbedInfo& last_embedding = lines.back().embeddings.back();
+    size_t last_glyph = last_embedding.embedding_level % 2 == 0 ? last_embedding.glyph_id.size() : 0;
+    int32_t line_height = (last_embedding.ascenders[last_glyph] - last_embedding.descenders[last_glyph]) * cur_lineheight;
     pen_y -= line_height;
     bottom_bearing += line_height;
     pen_x = indent;
     line_left_extra = 0;
     line_width.push_back(pen_x);
+    line_n_glyphs.push_back(0);
+    line_n_stretch.push_back(0);
+    line_n_may_stretch.push_back(0);
   }
 
   // If rtl, the pen is placed at the left
@@ -345,10 +425,38 @@ bool HarfBuzzShaper::finish_string() {
   int32_t bottom = pen_y + previous_line_descend - space_after;
   int max_width_ind = std::max_element(line_width.begin(), line_width.end()) - line_width.begin();
   width = max_width < 0 ? line_width[max_width_ind] : max_width;
+  if (!line_box_width.empty()) {
+    // The text box spans all line boxes
+    width = 0;
+    for (size_t i = 0; i < line_width.size(); ++i) {
+      width = std::max(width, line_offset(i) + line_box(i));
+    }
+  }
   height = -bottom;
 
   do_alignment(ltr);
 
+  // Move each line to its box
+  if (!line_box_offset.empty()) {
+    for (size_t i = 0; i < x_pos.size(); ++i) {
+      x_pos[i] += line_offset(line_id[i]);
+    }
+    pen_x += line_offset(line_width.size() - 1);
+    for (size_t i = 0; i < line_width.size(); ++i) {
+      line_width[i] += line_offset(i);
+    }
+    if (line_box_width.empty()) {
+      // Lines share the width they were aligned in but the text box spans them
+      // all once moved
+      int32_t line_box_shared = width;
+      width = 0;
+      for (size_t i = 0; i < line_width.size(); ++i) {
+        width = std::max(width, line_offset(i) + line_box_shared);
+      }
+    }
+    max_width_ind = std::max_element(line_width.begin(), line_width.end()) - line_width.begin();
+  }
+
   // Figure out additional space to left or right to add to bearing
   double width_diff = width - line_width[max_width_ind];
   if (cur_align == 1) {
@@ -371,8 +479,284 @@ bool HarfBuzzShaper::finish_string() {
   return true;
 }
 
+void HarfBuzzShaper::break_lines(std::list<EmbedInfo>& embeddings, std::vector<LayoutLine>& lines) {
+  // Justified paragraphs are broken so the spacing is as even as possible over
+  // the whole paragraph rather than filling one line at a time. This assumes
+  // that all lines share the same width so it is not used with line boxes
+  bool optimal = max_width >= 0 && line_box_width.empty() &&
+    (cur_align == 3 || cur_align == 4 || cur_align == 5 || cur_align == 8);
+  int32_t cur_line_indent = indent;
+  bool must_break = false;
+  bool paragraph_start = true;
+  uint32_t break_char;
+  while (!embeddings.empty()) {
+    if (optimal && paragraph_start && break_paragraph_optimal(embeddings, lines)) {
+      continue;
+    }
+    int32_t line_max_width = max_width - cur_line_indent;
+    if (!line_box_width.empty()) {
+      // To prevent rounding errors. A box narrower than the indent gets as
+      // little text as possible, as a negative width would mean no limit
+      line_max_width = std::max(line_box(lines.size()) + 1 - cur_line_indent, 0);
+    }
+    lines.emplace_back();
+    lines.back().embeddings = get_next_line_at_width(line_max_width, embeddings, must_break, break_char);
+    lines.back().hard_break = must_break;
+    cur_line_indent = must_break ? indent : hanging;
+    paragraph_start = must_break;
+  }
+}
+
+// Knuth and Plass' penalty for each line, making fewer lines preferable when
+// the spacing is otherwise the same
+static const double LINE_PENALTY = 10.0;
+// The badness of a line that can't be stretched to fill its width
+static const double MAX_BADNESS = 10000.0;
+// Only this many of the most recent feasible breaks are considered as the
+// start of a line. Keeps the work linear for paragraphs with many break
+// opportunities per line
+static const size_t MAX_ACTIVE_BREAKS = 128;
+
+struct BreakNode {
+  size_t pos;
+  double demerits;
+  int prev;
+};
+
+bool HarfBuzzShaper::break_paragraph_optimal(std::list<EmbedInfo>& embeddings, std::vector<LayoutLine>& lines) {
+  // Collect the glyphs of the paragraph in logical order along with the running
+  // width and stretchable width
+  std::vector<int32_t> advance;
+  std::vector<bool> stretch;
+  std::vector<size_t> candidates;
+  std::vector<int32_t> trim;
+  std::vector<int64_t> cum_width = {0};
+  std::vector<int64_t> cum_stretch = {0};
+  for (auto iter = embeddings.begin(); iter != embeddings.end(); ++iter) {
+    size_t n = iter->glyph_id.size();
+    bool ltr = iter->embedding_level % 2 == 0;
+    // The character ending the paragraph is removed from the line
+    size_t n_used = iter->terminates_paragraph && n > 0 ? n - 1 : n;
+    for (size_t k = 0; k < n_used; ++k) {
+      size_t i = ltr ? k : n - 1 - k;
+      if (iter->may_break[i]) {
+        candidates.push_back(advance.size());
+        // A blank glyph at the break may extend past the width, while a soft
+        // hyphen is replaced by a hyphen
+        if (full_string[iter->glyph_cluster[i]] == 173) {
+          trim.push_back(iter->x_advance[i] - hyphen_advance(*iter, i));
+        } else {
+          trim.push_back(iter->is_blank[i] ? iter->x_advance[i] : 0);
+        }
+      }
+      advance.push_back(iter->x_advance[i]);
+      stretch.push_back(iter->may_stretch[i]);
+      cum_width.push_back(cum_width.back() + advance.back());
+      cum_stretch.push_back(cum_stretch.back() + (stretch.back() ? advance.back() : 0));
+    }
+    if (iter->terminates_paragraph) break;
+  }
+  size_t n_glyphs = advance.size();
+  if (n_glyphs == 0) return false;
+  // The end of the paragraph is the final break
+  if (candidates.empty() || candidates.back() != n_glyphs - 1) {
+    candidates.push_back(n_glyphs - 1);
+    trim.push_back(0);
+  }
+
+  std::vector<BreakNode> nodes = {{0, 0.0, -1}};
+  std::vector<size_t> active = {0};
+  for (size_t c = 0; c < candidates.size(); ++c) {
+    size_t i = candidates[c];
+    size_t end = i + 1;
+    bool last = end == n_glyphs;
+    int64_t trailing = last ? 0 : trim[c];
+    double best = -1.0;
+    int best_node = -1;
+    for (size_t a = 0; a < active.size();) {
+      const BreakNode& node = nodes[active[a]];
+      int64_t line_max = max_width - (node.pos == 0 ? indent : hanging);
+      int64_t w = cum_width[end] - cum_width[node.pos] - trailing;
+      if (w > line_max) {
+        // Lines from this node only get longer
+        active.erase(active.begin() + a);
+        continue;
+      }
+      double badness = 0.0;
+      if (!last) {
+        // The first and last glyph of a line are never stretched
+        int64_t stretchable = cum_stretch[end] - cum_stretch[node.pos];
+        if (stretch[node.pos]) stretchable -= advance[node.pos];
+        if (stretch[i] && i != node.pos) stretchable -= advance[i];
+        double slack = line_max - w;
+        if (stretchable > 0) {
+          double ratio = slack / (0.5 * stretchable);
+          badness = std::min(100.0 * ratio * ratio * ratio, MAX_BADNESS);
+        } else if (slack > 0) {
+          badness = MAX_BADNESS;
+        }
+      }
+      double demerits = node.demerits + (LINE_PENALTY + badness) * (LINE_PENALTY + badness);
+      if (best_node < 0 || demerits < best) {
+        best = demerits;
+        best_node = active[a];
+      }
+      ++a;
+    }
+    if (best_node < 0) {
+      // Some part of the paragraph can't fit on a line. Leave it to the
+      // greedy breaking which can force breaks
+      return false;
+    }
+    nodes.push_back({end, best, best_node});
+    active.push_back(nodes.size() - 1);
+    if (active.size() > MAX_ACTIVE_BREAKS) active.erase(active.begin());
+  }
+
+  std::vector<size_t> breaks;
+  for (int node = nodes.back().prev; node > 0; node = nodes[node].prev) {
+    breaks.push_back(nodes[node].pos);
+  }
+  size_t taken = 0;
+  for (auto iter = breaks.rbegin(); iter != breaks.rend(); ++iter) {
+    lines.emplace_back();
+    lines.back().embeddings = get_next_line_at_glyph(*iter - taken, embeddings);
+    lines.back().hard_break = false;
+    taken = *iter;
+  }
+  // The last line runs to the end of the paragraph
+  bool must_break = false;
+  uint32_t break_char;
+  lines.emplace_back();
+  lines.back().embeddings = get_next_line_at_width(-1, embeddings, must_break, break_char);
+  lines.back().hard_break = must_break;
+  return true;
+}
+
+// Strings shorter than this are not worth splitting across threads
+static const size_t MIN_PARALLEL_STRING = 2048;
+static const size_t MIN_SEGMENT_SIZE = 256;
+
+bool HarfBuzzShaper::can_split_string(size_t n_threads) const {
+  return n_threads > 1 && full_string.size() >= MIN_PARALLEL_STRING && on_main_thread() &&
+    std::find(hard_break.begin(), hard_break.end(), true) != hard_break.end();
+}
+
+bool HarfBuzzShaper::break_lines_parallel(size_t n_threads, std::vector<LayoutLine>& lines) {
+  if (!can_split_string(n_threads)) {
+    return false;
+  }
+  size_t n_chars = full_string.size();
+
+  // Hard breaks always end a line so the text can be split after them and the
+  // segments broken into lines independently. Aim for a few segments per thread
+  // so the work can be balanced between them
+  size_t target = std::max(n_chars / (n_threads * 4), MIN_SEGMENT_SIZE);
+  std::vector<size_t> segment_start = {0};
+  for (size_t i = 0; i + 1 < n_chars; ++i) {
+    if (!hard_break[i]) continue;
+    size_t start = i + 1;
+    if (start - segment_start.back() >= target) segment_start.push_back(start);
+  }
+  size_t n_segments = segment_start.size();
+  if (n_segments < 2) return false;
+  segment_start.push_back(n_chars);
+
+  // The direction is decided by the full text, not by each segment
+  int direction = dir == 0 ? get_bidi_direction(full_string) : dir;
+
+  std::vector< std::vector<ShapeInfo> > segment_infos(n_segments);
+  size_t segment = 0;
+  for (auto iter = shape_infos.begin(); iter != shape_infos.end(); ++iter) {
+    while (segment < n_segments - 1 && iter->run_start >= segment_start[segment + 1]) {
+      segment++;
+    }
+    // Spacers and empty runs go with the text that follows them
+    if (iter->run_start == iter->run_end) {
+      segment_infos[segment].push_back(*iter);
+      segment_infos[segment].back().run_start -= segment_start[segment];
+      segment_infos[segment].back().run_end -= segment_start[segment];
+      continue;
+    }
+    // Text runs are split between the segments they cover
+    for (size_t i = segment; i < n_segments && segment_start[i] < iter->run_end; ++i) {
+      segment_infos[i].push_back(*iter);
+      ShapeInfo& part = segment_infos[i].back();
+      part.run_start = std::max(iter->run_start, segment_start[i]) - segment_start[i];
+      part.run_end = std::min(iter->run_end, segment_start[i + 1]) - segment_start[i];
+    }
+  }
+
+  std::vector< std::vector<LayoutLine> > segment_lines(n_segments);
+  n_threads = std::min(n_threads, n_segments);
+  prepare_hb_worker_shapers(n_threads);
+  parallel_for(n_segments, n_threads, [&](size_t i, size_t worker) {
+    HarfBuzzShaper& shaper = get_hb_worker_shaper(worker);
+    shaper.load_segment(*this, segment_start[i], segment_start[i + 1], segment_infos[i]);
+    int segment_direction = direction;
+    auto embeddings = shaper.combine_embeddings(shaper.shape_infos, segment_direction, true);
+    shaper.break_lines(embeddings, segment_lines[i]);
+    // Clusters must refer to the full text
+    for (auto line = segment_lines[i].begin(); line != segment_lines[i].end(); ++line) {
+      for (auto iter = line->embeddings.begin(); iter != line->embeddings.end(); ++iter) {
+        iter->shift_clusters(segment_start[i]);
+      }
+    }
+  });
+
+  for (size_t i = 0; i < n_segments; ++i) {
+    std::move(segment_lines[i].begin(), segment_lines[i].end(), std::back_inserter(lines));
+  }
+  dir = direction;
+  return true;
+}
+
+void HarfBuzzShaper::load_segment(const HarfBuzzShaper& parent, size_t start, size_t end,
+                                  std::vector<ShapeInfo>& segment_infos) {
+  reset();
+  full_string.assign(parent.full_string.begin() + start, parent.full_string.begin() + end);
+  text_info = scan_text(full_string.begin(), full_string.end());
+  soft_break.assign(parent.soft_break.begin() + start, parent.soft_break.begin() + end);
+  hard_break.assign(parent.hard_break.begin() + start, parent.hard_break.begin() + end);
+  shape_infos.swap(segment_infos);
+
+  cur_res = parent.cur_res;
+  cur_lineheight = parent.cur_lineheight;
+  cur_align = parent.cur_align;
+  cur_hjust = parent.cur_hjust;
+  cur_vjust = parent.cur_vjust;
+  max_width = parent.max_width;
+  indent = parent.indent;
+  hanging = parent.hanging;
+  space_before = parent.space_before;
+  space_after = parent.space_after;
+  dir = parent.dir;
+}
+
+void HarfBuzzShaper::swap_paragraph(ParagraphState& state) {
+  full_string.swap(state.full_string);
+  std::swap(text_info, state.text_info);
+  bidi_embedding.swap(state.bidi_embedding);
+  std::swap(bidi_resolved, state.bidi_resolved);
+  soft_break.swap(state.soft_break);
+  hard_break.swap(state.hard_break);
+  shape_infos.swap(state.shape_infos);
+  std::swap(cur_lineheight, state.lineheight);
+  std::swap(cur_align, state.align);
+  std::swap(cur_hjust, state.hjust);
+  std::swap(cur_vjust, state.vjust);
+  std::swap(cur_res, state.res);
+  std::swap(max_width, state.max_width);
+  std::swap(indent, state.indent);
+  std::swap(hanging, state.hanging);
+  std::swap(space_before, state.space_before);
+  std::swap(space_after, state.space_after);
+  std::swap(dir, state.dir);
+}
+
 void HarfBuzzShaper::reset() {
   full_string.clear();
+  text_info = TextInfo();
   bidi_embedding.clear();
   glyph_id.clear();
   glyph_cluster.clear();
@@ -390,6 +774,9 @@ void HarfBuzzShaper::reset() {
   line_width.clear();
   line_id.clear();
   line_must_break.clear();
+  line_n_glyphs.clear();
+  line_n_stretch.clear();
+  line_n_may_stretch.clear();
   may_stretch.clear();
   shape_infos.clear();
   soft_break.clear();
@@ -416,6 +803,7 @@ void HarfBuzzShaper::reset() {
 
   error_code = 0;
   dir = 0;
+  bidi_resolved = false;
 
   cur_lineheight = 0.0;
   cur_align = 0;
@@ -425,18 +813,67 @@ void HarfBuzzShaper::reset() {
   top = 0;
   bottom = 0;
   max_width = 0;
+  line_box_width.clear();
+  line_box_offset.clear();
   indent = 0;
   hanging = 0;
   space_before = 0;
   space_after = 0;
 }
 
-std::list<EmbedInfo> HarfBuzzShaper::combine_embeddings(std::vector<ShapeInfo>& shapes, int& direction) {
+FT_Face HarfBuzzShaper::get_face(const char* fontfile, int index, double size, double res, int* error) {
+  if (library == NULL) {
+    return get_cached_or_new_face(fontfile, index, size, res, error);
+  }
+  FaceID key = {fontfile, (unsigned int) index, size, res};
+  auto cached = face_cache.find(key);
+  if (cached != face_cache.end()) {
+    // The caller gets its own reference just like with the systemfonts cache
+    FT_Reference_Face(cached->second);
+    return cached->second;
+  }
+  FT_Face face = new_sized_face(library, fontfile, index, size, res, error);
+  if (face == NULL) {
+    return face;
+  }
+  if (face_cache.size() >= FACE_CACHE_SIZE) {
+    clear_face_cache();
+  }
+  FT_Reference_Face(face);
+  face_cache[key] = face;
+  return face;
+}
+
+void HarfBuzzShaper::clear_face_cache() {
+  for (auto iter = face_cache.begin(); iter != face_cache.end(); ++iter) {
+    FT_Done_Face(iter->second);
+  }
+  face_cache.clear();
+}
+
+void HarfBuzzShaper::report_face_error(const FontSettings& font_info) {
+  // The error code is still set if the message can't be printed
+  try_run_on_main_thread([&]() {
+    Rprintf("Failed to get face: %s, %i\n", font_info.file, font_info.index);
+  });
+}
+
+void HarfBuzzShaper::resolve_bidi(int& direction, bool segment) {
+  if (bidi_resolved) return;
+  bidi_resolved = true;
   // Find bidi embeddings and determine the overall direction of the text
-  if (full_string.size() > 1) {
+  // Segments of a larger text always need them as the direction is given
+  if (full_string.size() > 1 || (segment && !full_string.empty())) {
+    // Text without any RTL characters in an LTR or auto paragraph is all at
+    // level 0 so we don't need fribidi for it
+    if (direction != 2 && !text_info.has_rtl) {
+      bidi_embedding.assign(full_string.size(), 0);
+      direction = 1;
+      return;
+    }
     // If we have more than one char we find bidi embeddings
     // We append the direction to the end in the cache so we can read it back
-    BidiID key = {vector_hash(full_string.begin(), full_string.end()), direction};
+    BidiID key = {text_info.hash(), direction};
     if (!bidi_cache.get(key, bidi_embedding)) {
       bidi_embedding = get_bidi_embeddings(full_string, direction);
       bidi_embedding.push_back(direction);
@@ -449,22 +886,34 @@ std::list<EmbedInfo> HarfBuzzShaper::combine_embeddings(std::vector<ShapeInfo>&
   } else {
     bidi_embedding = std::vector<int>(full_string.size(), 0);
   }
+}
+
+void HarfBuzzShaper::shape_runs(std::vector<ShapeInfo>& shapes, bool ltr) {
+  for (auto iter = shapes.begin(); iter != shapes.end(); ++iter) {
+    // Spacers are created already shaped and text runs may have been shaped
+    // in an earlier stage
+    if (iter->run_start != iter->run_end && iter->embeddings.empty()) {
+      shape_text_run(*iter, ltr);
+    }
+  }
+}
+
+std::list<EmbedInfo> HarfBuzzShaper::combine_embeddings(std::vector<ShapeInfo>& shapes, int& direction, bool segment) {
+  resolve_bidi(direction, segment);
 
   // If size < 2 we haven't done any guessing and we assume ltr (it doesn't matter anyway)
   bool ltr = direction != 2;
 
   // Shape all embeddings and collect them in a single vector
+  shape_runs(shapes, ltr);
   std::list<EmbedInfo> all_embeddings;
-  unsigned int i = 0;
   for (auto iter = shapes.begin(); iter != shapes.end(); ++iter) {
-    if (iter->embeddings.empty()) { // avoid shaping spacers
-      shape_text_run(*iter, ltr);
-    } else {
+    if (iter->run_start == iter->run_end) {
       // We adopt the embedding level of the prior embedding for spacers
       int level = all_embeddings.empty() ? (ltr ? 0 : 1) : all_embeddings.back().embedding_level;
       iter->embeddings[0].embedding_level = level;
     }
-    iter->add_index(i++);
+    iter->add_index(iter->index);
     all_embeddings.insert(all_embeddings.end(), std::make_move_iterator(iter->embeddings.begin()), std::make_move_iterator(iter->embeddings.end()));
     iter->embeddings.clear();
   }
@@ -509,13 +958,26 @@ void HarfBuzzShaper::shape_text_run(ShapeInfo &text_run, bool ltr) {
   ShapeID run_id;
   if (n_features == 0) {
     // No features. This is a simple string and if we have already seen it it may be in the cache
-    run_id.string_hash = vector_hash(full_string.begin() + text_run.run_start, full_string.begin() + text_run.run_end);
+    if (text_run.run_start == 0 && text_run.run_end == full_string.size()) {
+      run_id.string_hash = text_info.hash();
+    } else {
+      run_id.string_hash = vector_hash(full_string.begin() + text_run.run_start, full_string.begin() + text_run.run_end);
+    }
     run_id.embed_hash = vector_hash(bidi_embedding.begin() + text_run.run_start, bidi_embedding.begin() + text_run.run_end);
     run_id.font.assign(text_run.font_info.file);
     run_id.index = text_run.font_info.index;
     run_id.size = text_run.size * text_run.res;
     run_id.tracking = text_run.tracking;
+    run_id.width_only = width_only;
+    size_t run_start = text_run.run_start;
+    size_t run_end = text_run.run_end;
     if (shape_cache.get(run_id, text_run)) {
+      // Clusters are cached relative to the start of the run
+      text_run.run_start = run_start;
+      text_run.run_end = run_end;
+      for (auto iter = text_run.embeddings.begin(); iter != text_run.embeddings.end(); ++iter) {
+        iter->shift_clusters(run_start);
+      }
       return;
     }
   } else {
@@ -549,9 +1011,9 @@ void HarfBuzzShaper::shape_text_run(ShapeInfo &text_run, bool ltr) {
 #if HB_VERSION_MAJOR < 2 && HB_VERSION_MINOR < 2
 #else
     int error = 0;
-    FT_Face face = get_cached_or_new_face(text_run.font_info.file, text_run.font_info.index, text_run.size, text_run.res, &error);
+    FT_Face face = get_face(text_run.font_info.file, text_run.font_info.index, text_run.size, text_run.res, &error);
     if (error != 0) {
-      Rprintf("Failed to get face: %s, %i\n", text_run.font_info.file, text_run.font_info.index);
+      report_face_error(text_run.font_info);
       error_code = error;
     } else {
       hb_font_t *font = hb_ft_font_create_referenced(face);
@@ -569,7 +1031,7 @@ void HarfBuzzShaper::shape_text_run(ShapeInfo &text_run, bool ltr) {
 
   // Heuristic check to see if the string might contain emoji chars
   bool may_have_emoji = false;
-  for (int i = text_run.run_start; i < text_run.run_end; ++i) {
+  for (int i = text_run.run_start; i < text_run.run_end && text_info.may_have_emoji; ++i) {
     if (full_string[i] >= 8205) {
       may_have_emoji = true;
       break;
@@ -582,14 +1044,18 @@ void HarfBuzzShaper::shape_text_run(ShapeInfo &text_run, bool ltr) {
     // This depends on the font so we can't cache this as part of the embedding
     std::vector<int> emoji_embeddings = {};
     emoji_embeddings.resize(n_chars);
-    detect_emoji_embedding(full_string.data() + text_run.run_start, n_chars, emoji_embeddings.data(), text_run.font_info.file, text_run.font_info.index);
+    run_serialised([&]() {
+      detect_emoji_embedding(full_string.data() + text_run.run_start, n_chars, emoji_embeddings.data(), text_run.font_info.file, text_run.font_info.index);
+    });
     bool emoji_font_added = false;
     for (int i = 0; i < n_chars; ++i) {
       if (emoji_embeddings[i] == 1) {
-        bidi_embedding[i] *= -1;
+        bidi_embedding[text_run.run_start + i] *= -1;
         if (!emoji_font_added) {
           // Add the system emoji font to fallbacks
-          fallback.push_back(locate_font_with_features("emoji", 0, 0));
+          run_serialised([&]() {
+            fallback.push_back(locate_font_with_features("emoji", 0, 0));
+          });
           if (!get_font_sizing(fallback.back(), text_run.size, text_run.res, fallback_size, fallback_scaling, true)) {
             return;
           }
@@ -625,38 +1091,146 @@ void HarfBuzzShaper::shape_text_run(ShapeInfo &text_run, bool ltr) {
 
   if (n_features == 0) {
     // If simply shape add to cache
-    shape_cache.add(run_id, text_run);
+    ShapeInfo cached_run = text_run;
+    for (auto iter = cached_run.embeddings.begin(); iter != cached_run.embeddings.end(); ++iter) {
+      iter->shift_clusters(-int64_t(text_run.run_start));
+    }
+    shape_cache.add(run_id, cached_run);
   }
   //FT_Done_Face(face);
   return;
 }
 
 
-EmbedInfo HarfBuzzShaper::shape_single_line(const char* string, FontSettings& font_info, double size, double res) {
+const std::list<EmbedInfo>& HarfBuzzShaper::shape_single_line_runs(const char* string, FontSettings& font_info, double size, double res) {
   // Fast version when we know we don't need word wrap and alignment
-  // Used by graphics devices
+  // Used by graphics devices. The runs are returned in visual order and stay
+  // valid until the next call
 
   reset();
+  line_runs.clear();
 
   int n_chars = 0;
-  const uint32_t* utc_string = utf_converter.convert_to_ucs(string, n_chars);
+  const uint32_t* utc_string = utf_converter.convert_to_ucs(string, n_chars, text_info);
 
-  full_string = {utc_string, utc_string + n_chars};
+  full_string.assign(utc_string, utc_string + n_chars);
 
   std::vector<ShapeInfo> shapes = {ShapeInfo(0, full_string.size(), font_info, 0, size, res, 0)};
-  if (shapes.empty()) return EmbedInfo();
   int direction = 0;
-  auto final_embeddings = combine_embeddings(shapes, direction);
+  line_runs = combine_embeddings(shapes, direction);
+
+  if (line_runs.empty()) return line_runs;
+
+  rearrange_embeddings(line_runs);
+  return line_runs;
+}
+
+bool HarfBuzzShaper::shape_single_line_width(const char* string, FontSettings& font_info, double size, double res, int32_t& width) {
+  // Only sums the advances so glyph extents and per-glyph flags are skipped
+  // and the embeddings are neither merged nor reordered. Runs shaped this way
+  // are cached separately from fully shaped runs
 
-  if (final_embeddings.empty()) return EmbedInfo();
+  reset();
+
+  int n_chars = 0;
+  const uint32_t* utc_string = utf_converter.convert_to_ucs(string, n_chars, text_info);
 
-  rearrange_embeddings(final_embeddings);
+  full_string.assign(utc_string, utc_string + n_chars);
+
+  std::vector<ShapeInfo> shapes = {ShapeInfo(0, full_string.size(), font_info, 0, size, res, 0)};
+  int direction = 0;
+  resolve_bidi(direction);
+  width_only = true;
+  try {
+    shape_runs(shapes, direction != 2);
+  } catch (...) {
+    width_only = false;
+    throw;
+  }
+  width_only = false;
+
+  if (error_code != 0) return false;
+
+  width = 0;
+  for (auto shape = shapes.begin(); shape != shapes.end(); ++shape) {
+    for (auto embedding = shape->embeddings.begin(); embedding != shape->embeddings.end(); ++embedding) {
+      for (auto advance = embedding->x_advance.begin(); advance != embedding->x_advance.end(); ++advance) {
+        width += *advance;
+      }
+    }
+  }
+  return true;
+}
+
+EmbedInfo HarfBuzzShaper::shape_single_line(const char* string, FontSettings& font_info, double size, double res) {
+  const std::list<EmbedInfo>& runs = shape_single_line_runs(string, font_info, size, res);
+
+  if (runs.empty()) return EmbedInfo();
 
   // Combine all embeddings into one
-  for (auto iter = std::next(final_embeddings.begin()); iter != final_embeddings.end(); ++iter) {
-    final_embeddings.front().add(*iter, false);
+  EmbedInfo line = runs.front();
+  for (auto iter = std::next(runs.begin()); iter != runs.end(); ++iter) {
+    line.add(*iter, false);
   }
-  return final_embeddings.front();
+  return line;
+}
+
+bool HarfBuzzShaper::glyph_metrics(uint32_t codepoint, FontSettings& font_info, double size, double res, GlyphMetrics& metrics) {
+  // Metrics of single characters as requested by graphics devices. Characters
+  // the font has a glyph for are read directly from the font unless features
+  // are set, as they may substitute the glyph. Everything else, along with
+  // characters that may be emoji, goes through the full shaping so font
+  // fallback works as for strings
+  GlyphMetricID key = {font_info.file, (unsigned int) font_info.index, size, res, codepoint, features_hash(font_info)};
+  if (metric_cache.get(key, metrics)) {
+    return true;
+  }
+
+  hb_codepoint_t glyph = 0;
+  if (codepoint < 8205 && font_info.n_features == 0) {
+    int error = 0;
+    FT_Face face = get_face(font_info.file, font_info.index, size, res, &error);
+    if (error != 0) {
+      report_face_error(font_info);
+      error_code = error;
+      return false;
+    }
+    double scaling = FT_IS_SCALABLE(face) ? 1.0 : size * 64.0 * res / 72.0 / face->size->metrics.height * family_scaling(face->family_name);
+    hb_font_t *font = hb_ft_font_create_referenced(face);
+    FT_Done_Face(face);
+    if (hb_font_get_nominal_glyph(font, codepoint, &glyph)) {
+      hb_glyph_extents_t extent;
+      hb_font_get_glyph_extents(font, glyph, &extent);
+      // Clamped like the metrics of shaped glyphs below
+      metrics.ascent = std::max(0, extent.y_bearing) * scaling / 64.0;
+      metrics.descent = std::max(0, -(extent.y_bearing + extent.height)) * scaling / 64.0;
+      metrics.width = hb_font_get_glyph_h_advance(font, glyph) * scaling / 64.0;
+    }
+    hb_font_destroy(font);
+  }
+
+  if (glyph == 0) {
+    char string[5] = {0};
+    u8_toutf8(string, 4, &codepoint, 1);
+    EmbedInfo shape = shape_single_line(string, font_info, size, res);
+    if (error_code != 0) {
+      return false;
+    }
+    int32_t ascent = 0;
+    int32_t descent = 0;
+    int32_t width = 0;
+    for (size_t i = 0; i < shape.glyph_id.size(); ++i) {
+      ascent = std::max(ascent, shape.y_bear[i]);
+      descent = std::max(descent, -(shape.y_bear[i] + shape.height[i]));
+      width += shape.x_advance[i];
+    }
+    metrics.ascent = ascent / 64.0;
+    metrics.descent = descent / 64.0;
+    metrics.width = width / 64.0;
+  }
+
+  metric_cache.add(key, metrics);
+  return true;
 }
 
 bool HarfBuzzShaper::shape_embedding(unsigned int start, unsigned int end,
@@ -674,7 +1248,7 @@ bool HarfBuzzShaper::shape_embedding(unsigned int start, unsigned int end,
   int error = 0;
   // Load main font (emoji if dir is negative)
   // Shouldn't be able to fail as we have already tried to load it in the calling function
-  FT_Face face = get_cached_or_new_face(
+  FT_Face face = get_face(
     fallbacks[dir < 0 ? 1 : 0].file,
     fallbacks[dir < 0 ? 1 : 0].index,
     shape_info.size,
@@ -690,16 +1264,25 @@ bool HarfBuzzShaper::shape_embedding(unsigned int start, unsigned int end,
 
   // Do a first run of shaping. Hopefully it's enough
   unsigned int n_glyphs = 0;
-  hb_buffer_reset(buffer);
-  hb_buffer_add_utf32(buffer, full_string.data(), full_string.size(), start, embedding_size);
-  hb_buffer_guess_segment_properties(buffer);
-  hb_buffer_set_direction(buffer, dir % 2 == 0 ? HB_DIRECTION_LTR : HB_DIRECTION_RTL);
   hb_glyph_info_t *glyph_info = NULL;
+  hb_glyph_position_t *glyph_pos = NULL;
+  SimpleFont simple_font;
+  bool simple = features.empty() && dir >= 0 && dir % 2 == 0 &&
+    font_is_simple(fallbacks[0], face, font, simple_font) &&
+    shape_simple(start, end, font, simple_font, fallbacks[0], shape_info.size, shape_info.res);
+  if (simple) {
+    n_glyphs = embedding_size;
+    glyph_info = simple_info.data();
+  } else {
+    hb_buffer_reset(buffer);
+    hb_buffer_add_utf32(buffer, full_string.data(), full_string.size(), start, embedding_size);
+    hb_buffer_guess_segment_properties(buffer);
+    hb_buffer_set_direction(buffer, dir % 2 == 0 ? HB_DIRECTION_LTR : HB_DIRECTION_RTL);
 
-  hb_shape(font, buffer, features.data(), features.size());
+    hb_shape(font, buffer, features.data(), features.size());
 
-  hb_glyph_position_t *glyph_pos = NULL;
-  glyph_info = hb_buffer_get_glyph_infos(buffer, &n_glyphs);
+    glyph_info = hb_buffer_get_glyph_infos(buffer, &n_glyphs);
+  }
 
   if (n_glyphs == 0) {
     hb_font_destroy(font);
@@ -720,7 +1303,7 @@ bool HarfBuzzShaper::shape_embedding(unsigned int start, unsigned int end,
   annotate_fallbacks(current_font + 1, embedding_size, char_font, glyph_info, n_glyphs, needs_fallback, any_resolved, embed_is_ltr, start);
 
   if (!needs_fallback) { // Short route - use existing shaping
-    glyph_pos = hb_buffer_get_glyph_positions(buffer, &n_glyphs);
+    glyph_pos = simple ? simple_pos.data() : hb_buffer_get_glyph_positions(buffer, &n_glyphs);
     fill_shape_info(glyph_info, glyph_pos, n_glyphs, font, current_font, start, shape_info, fallback_sizes, fallback_scales);
     fill_glyph_info(shape_info.embeddings.back());
     hb_font_destroy(font);
@@ -753,7 +1336,7 @@ bool HarfBuzzShaper::shape_embedding(unsigned int start, unsigned int end,
       any_resolved = true;
     }
     if (error_code != 0) {
-      Rprintf("Failed to get face: %s, %i\n", fallbacks[current_font].file, fallbacks[current_font].index);
+      report_face_error(fallbacks[current_font]);
       shape_info.embeddings.pop_back();
       return false;
     }
@@ -796,11 +1379,11 @@ bool HarfBuzzShaper::shape_embedding(unsigned int start, unsigned int end,
         // Move on until we hit a new font. Then shape everything up until current point
         // and add to embedding struct
         int error = 0;
-        FT_Face face = get_cached_or_new_face(fallbacks[current_font].file,
+        FT_Face face = get_face(fallbacks[current_font].file,
                                               fallbacks[current_font].index,
                                               shape_info.size, shape_info.res, &error);
         if (error != 0) {
-          Rprintf("Failed to get face: %s, %i\n", fallbacks[current_font].file, fallbacks[current_font].index);
+          report_face_error(fallbacks[current_font]);
           error_code = error;
           return false;
         }
@@ -832,11 +1415,11 @@ bool HarfBuzzShaper::shape_embedding(unsigned int start, unsigned int end,
     for (int i = text_run_end - 1; i >= 0; --i) {
       if (i <= 0 || char_font[i - 1] != current_font) {
         int error = 0;
-        FT_Face face = get_cached_or_new_face(fallbacks[current_font].file,
+        FT_Face face = get_face(fallbacks[current_font].file,
                                               fallbacks[current_font].index,
                                               shape_info.size, shape_info.res, &error);
         if (error != 0) {
-          Rprintf("Failed to get face: %s, %i\n", fallbacks[current_font].file, fallbacks[current_font].index);
+          report_face_error(fallbacks[current_font]);
           error_code = error;
           return false;
         }
@@ -883,11 +1466,13 @@ hb_font_t*  HarfBuzzShaper::load_fallback(unsigned int font, unsigned int start,
   if (font >= fallbacks.size()) {
     int n_conv = 0;
     const char* fallback_string = utf_converter.convert_to_utf(full_string.data() + start, end - start, n_conv);
-    fallbacks.push_back(
-      get_fallback(fallback_string,
-                   fallbacks[0].file,
-                   fallbacks[0].index)
-    );
+    run_serialised([&]() {
+      fallbacks.push_back(
+        get_fallback(fallback_string,
+                     fallbacks[0].file,
+                     fallbacks[0].index)
+      );
+    });
     new_added = true;
   }
   FT_Face face = get_font_sizing(fallbacks[font], shape_info.size, shape_info.res, fallback_sizes, fallback_scales);
@@ -959,6 +1544,347 @@ void HarfBuzzShaper::annotate_fallbacks(unsigned int font, unsigned int buffer_e
   }
 }
 
+// Big endian reads from an OpenType table, failing on offsets past its end
+static bool read_u16(const char* data, size_t length, size_t offset, uint16_t& value) {
+  if (offset + 2 > length) return false;
+  value = uint16_t((unsigned char) data[offset]) << 8 | (unsigned char) data[offset + 1];
+  return true;
+}
+static bool read_u32(const char* data, size_t length, size_t offset, uint32_t& value) {
+  uint16_t high = 0, low = 0;
+  if (!read_u16(data, length, offset, high) || !read_u16(data, length, offset + 2, low)) return false;
+  value = uint32_t(high) << 16 | low;
+  return true;
+}
+
+// Whether a GPOS lookup only adjusts the advance of the first glyph of pairs,
+// as kerning does. HarfBuzz then applies it to each pair of adjacent glyphs
+// independently so its effect can be found one pair at a time. A lookup
+// adjusting the second glyph makes HarfBuzz skip that glyph as the start of the
+// next pair
+static bool is_kerning_lookup(const char* data, size_t length, unsigned int index) {
+  uint16_t lookup_list = 0, n_lookups = 0, lookup_offset = 0;
+  if (!read_u16(data, length, 8, lookup_list) ||
+      !read_u16(data, length, lookup_list, n_lookups) || index >= n_lookups ||
+      !read_u16(data, length, lookup_list + 2 + 2 * size_t(index), lookup_offset)) {
+    return false;
+  }
+  size_t lookup = size_t(lookup_list) + lookup_offset;
+  uint16_t type = 0, flag = 0, n_subtables = 0;
+  if (!read_u16(data, length, lookup, type) || !read_u16(data, length, lookup + 2, flag) ||
+      !read_u16(data, length, lookup + 4, n_subtables) || n_subtables == 0) {
+    return false;
+  }
+  // Skipping base glyphs would pair glyphs that aren't adjacent
+  if (flag & 0x0002) return false;
+  for (size_t i = 0; i < n_subtables; ++i) {
+    uint16_t subtable_offset = 0;
+    if (!read_u16(data, length, lookup + 6 + 2 * i, subtable_offset)) return false;
+    size_t subtable = lookup + subtable_offset;
+    uint16_t subtable_type = type;
+    if (type == 9) { // Extension
+      uint32_t extension_offset = 0;
+      if (!read_u16(data, length, subtable + 2, subtable_type) ||
+          !read_u32(data, length, subtable + 4, extension_offset)) {
+        return false;
+      }
+      subtable += extension_offset;
+    }
+    uint16_t format_first = 0, format_second = 0;
+    if (subtable_type != 2 ||
+        !read_u16(data, length, subtable + 4, format_first) ||
+        !read_u16(data, length, subtable + 6, format_second)) {
+      return false;
+    }
+    // Only XAdvance for the first glyph and nothing for the second
+    if ((format_first & ~0x0004) != 0 || format_second != 0) return false;
+  }
+  return true;
+}
+
+// Whether a legacy kern table only holds horizontal pair kerning (format 0 and
+// 2 subtables) which HarfBuzz also applies to each pair independently. The
+// left glyphs of format 0 pairs are added to kerned. Format 2 subtables are
+// class based so any glyph may be kerned by them
+static bool read_kern_table(const char* data, size_t length, hb_set_t* kerned, bool& kern_all) {
+  uint16_t version = 0, n_tables = 0;
+  if (!read_u16(data, length, 0, version) || version != 0 ||
+      !read_u16(data, length, 2, n_tables)) {
+    return false;
+  }
+  size_t offset = 4;
+  for (size_t i = 0; i < n_tables; ++i) {
+    uint16_t subtable_length = 0, coverage = 0;
+    if (!read_u16(data, length, offset + 2, subtable_length) ||
+        !read_u16(data, length, offset + 4, coverage)) {
+      return false;
+    }
+    int format = coverage >> 8;
+    // Horizontal, not minimum values and not cross-stream
+    if ((coverage & 0x0007) != 0x0001 || (format != 0 && format != 2)) return false;
+    if (format == 2) {
+      kern_all = true;
+    } else {
+      uint16_t n_pairs = 0;
+      if (!read_u16(data, length, offset + 6, n_pairs)) return false;
+      for (size_t j = 0; j < n_pairs; ++j) {
+        uint16_t left = 0;
+        if (!read_u16(data, length, offset + 14 + 6 * j, left)) return false;
+        hb_set_add(kerned, left);
+      }
+    }
+    offset += subtable_length;
+  }
+  return true;
+}
+
+bool HarfBuzzShaper::font_is_simple(const FontSettings& font_info, FT_Face face, hb_font_t* font, SimpleFont& simple_font) {
+  // Finds the characters that HarfBuzz shapes by mapping them to a glyph
+  // through the cmap and using the glyph advance, apart from pair kerning.
+  // These are the characters whose glyphs aren't input to any lookup of the
+  // features HarfBuzz applies by default to horizontal Latin text, except for
+  // lookups doing pair kerning. The lookups don't depend on the size so the
+  // result is cached per font
+  FaceID key = {font_info.file, (unsigned int) font_info.index, 0.0, 0.0};
+  if (simple_font_cache.get(key, simple_font)) {
+    return simple_font.simple;
+  }
+  simple_font.simple = false;
+  simple_font.monospace = false;
+  simple_font.ascii_glyphs.fill(0);
+  simple_font.chars.fill(0);
+
+  // AAT shaping replaces the OpenType tables when present
+  static const FT_ULong aat_tables[] = {
+    FT_MAKE_TAG('m', 'o', 'r', 'x'), FT_MAKE_TAG('m', 'o', 'r', 't'),
+    FT_MAKE_TAG('k', 'e', 'r', 'x'), FT_MAKE_TAG('t', 'r', 'a', 'k')
+  };
+  bool simple = FT_IS_SFNT(face);
+  for (size_t i = 0; i < sizeof(aat_tables) / sizeof(FT_ULong) && simple; ++i) {
+    FT_ULong length = 0;
+    simple = FT_Load_Sfnt_Table(face, aat_tables[i], 0, NULL, &length) != 0;
+  }
+
+  hb_face_t* hb_face = hb_font_get_face(font);
+  hb_set_t* kerned = hb_set_create();
+  bool kern_all = false;
+  if (simple) {
+    hb_blob_t* kern = hb_face_reference_table(hb_face, HB_TAG('k', 'e', 'r', 'n'));
+    unsigned int length = 0;
+    const char* data = hb_blob_get_data(kern, &length);
+    if (length > 0) {
+      simple = read_kern_table(data, length, kerned, kern_all);
+    }
+    hb_blob_destroy(kern);
+  }
+
+  if (simple) {
+    static const hb_tag_t default_features[] = {
+      HB_TAG('r', 'v', 'r', 'n'), HB_TAG('l', 't', 'r', 'a'), HB_TAG('l', 't', 'r', 'm'),
+      HB_TAG('r', 'a', 'n', 'd'), HB_TAG('a', 'b', 'v', 'm'), HB_TAG('b', 'l', 'w', 'm'),
+      HB_TAG('c', 'c', 'm', 'p'), HB_TAG('l', 'o', 'c', 'l'), HB_TAG('m', 'a', 'r', 'k'),
+      HB_TAG('m', 'k', 'm', 'k'), HB_TAG('r', 'l', 'i', 'g'), HB_TAG('c', 'a', 'l', 't'),
+      HB_TAG('c', 'l', 'i', 'g'), HB_TAG('c', 'u', 'r', 's'), HB_TAG('d', 'i', 's', 't'),
+      HB_TAG('k', 'e', 'r', 'n'), HB_TAG('l', 'i', 'g', 'a'), HB_TAG('r', 'c', 'l', 't'),
+      HB_TAG_NONE
+    };
+    hb_set_t* lookups = hb_set_create();
+    hb_set_t* touched = hb_set_create();
+
+    // Lookups are collected for all scripts and languages as the one used
+    // depends on the text and locale
+    hb_ot_layout_collect_lookups(hb_face, HB_OT_TAG_GSUB, NULL, NULL, default_features, lookups);
+    hb_codepoint_t lookup = HB_SET_VALUE_INVALID;
+    while (hb_set_next(lookups, &lookup)) {
+      hb_ot_layout_lookup_collect_glyphs(hb_face, HB_OT_TAG_GSUB, lookup, NULL, touched, NULL, NULL);
+    }
+
+    hb_set_clear(lookups);
+    hb_ot_layout_collect_lookups(hb_face, HB_OT_TAG_GPOS, NULL, NULL, default_features, lookups);
+    hb_blob_t* gpos = hb_face_reference_table(hb_face, HB_OT_TAG_GPOS);
+    unsigned int gpos_length = 0;
+    const char* gpos_data = hb_blob_get_data(gpos, &gpos_length);
+    lookup = HB_SET_VALUE_INVALID;
+    while (hb_set_next(lookups, &lookup)) {
+      hb_set_t* input = is_kerning_lookup(gpos_data, gpos_length, lookup) ? kerned : touched;
+      hb_ot_layout_lookup_collect_glyphs(hb_face, HB_OT_TAG_GPOS, lookup, NULL, input, NULL, NULL);
+    }
+    hb_blob_destroy(gpos);
+
+    for (uint32_t c = 0; c < simple_font.chars.size(); ++c) {
+      hb_codepoint_t glyph = 0;
+      if (!is_simple_latin(c) || !hb_font_get_nominal_glyph(font, c, &glyph) || hb_set_has(touched, glyph)) {
+        continue;
+      }
+      // Marks and ligatures may be skipped by lookups
+      hb_ot_layout_glyph_class_t glyph_class = hb_ot_layout_get_glyph_class(hb_face, glyph);
+      if (glyph_class != HB_OT_LAYOUT_GLYPH_CLASS_UNCLASSIFIED &&
+          glyph_class != HB_OT_LAYOUT_GLYPH_CLASS_BASE_GLYPH) {
+        continue;
+      }
+      simple_font.chars[c] = SIMPLE_CHAR;
+      if (kern_all || hb_set_has(kerned, glyph)) {
+        simple_font.chars[c] |= SIMPLE_KERN;
+      }
+    }
+    hb_set_destroy(lookups);
+    hb_set_destroy(touched);
+  }
+  hb_set_destroy(kerned);
+  simple_font.simple = simple;
+
+  // A font is monospaced if the unscaled advances of printable ASCII are all
+  // the same, whether or not it claims to be fixed pitch. HarfBuzz scales them
+  // without hinting so they stay the same at any size. Variable fonts may vary
+  // them. Whether the layout tables leave the glyphs alone is decided per
+  // character by shape_monospace()
+  bool monospace = simple && !FT_HAS_MULTIPLE_MASTERS(face);
+  FT_Fixed first_advance = 0;
+  for (size_t i = 0; i < simple_font.ascii_glyphs.size() && monospace; ++i) {
+    FT_UInt glyph = FT_Get_Char_Index(face, 0x20 + i);
+    FT_Fixed advance = 0;
+    monospace = glyph != 0 && FT_Get_Advance(face, glyph, FT_LOAD_NO_SCALE, &advance) == 0;
+    if (i == 0) first_advance = advance;
+    monospace = monospace && advance == first_advance;
+    simple_font.ascii_glyphs[i] = glyph;
+  }
+  simple_font.monospace = monospace;
+
+  simple_font_cache.add(key, simple_font);
+  return simple;
+}
+
+bool HarfBuzzShaper::shape_simple(unsigned int start, unsigned int end, hb_font_t* font,
+                                  const SimpleFont& simple_font, const FontSettings& font_info,
+                                  double size, double res) {
+  // Shape Latin text in a simple font the way hb_shape() would. Gives up if a
+  // character isn't simple in the font so the regular shaping can handle it
+  if (simple_font.monospace && shape_monospace(start, end, font, simple_font)) {
+    return true;
+  }
+  unsigned int n_chars = end - start;
+  simple_info.resize(n_chars);
+  simple_pos.resize(n_chars);
+  hb_unicode_funcs_t* unicode = hb_unicode_funcs_get_default();
+  hb_script_t script = HB_SCRIPT_INVALID;
+  bool kerned = false;
+  for (unsigned int i = 0; i < n_chars; ++i) {
+    uint32_t c = full_string[start + i];
+    hb_codepoint_t glyph = 0;
+    if (c >= simple_font.chars.size() || !(simple_font.chars[c] & SIMPLE_CHAR) ||
+        !hb_font_get_nominal_glyph(font, c, &glyph)) {
+      return false;
+    }
+    simple_info[i] = hb_glyph_info_t();
+    simple_info[i].codepoint = glyph;
+    simple_info[i].cluster = start + i;
+    simple_pos[i] = hb_glyph_position_t();
+    simple_pos[i].x_advance = hb_font_get_glyph_h_advance(font, glyph);
+    kerned = kerned || (i + 1 < n_chars && (simple_font.chars[c] & SIMPLE_KERN));
+    // The script is guessed like hb_buffer_guess_segment_properties() does
+    if (script == HB_SCRIPT_INVALID) {
+      hb_script_t char_script = hb_unicode_script(unicode, c);
+      if (char_script != HB_SCRIPT_COMMON && char_script != HB_SCRIPT_INHERITED &&
+          char_script != HB_SCRIPT_UNKNOWN) {
+        script = char_script;
+      }
+    }
+  }
+  if (!kerned) {
+    return true;
+  }
+
+  FaceID key = {font_info.file, (unsigned int) font_info.index, size, res};
+  auto font_pairs = kern_pairs.find(key);
+  if (font_pairs == kern_pairs.end()) {
+    if (kern_pairs.size() >= FACE_CACHE_SIZE) {
+      kern_pairs.clear();
+    }
+    font_pairs = kern_pairs.emplace(key, std::unordered_map<uint32_t, hb_position_t>()).first;
+  }
+  for (unsigned int i = 0; i + 1 < n_chars; ++i) {
+    uint32_t first = full_string[start + i];
+    if (!(simple_font.chars[first] & SIMPLE_KERN)) {
+      continue;
+    }
+    uint32_t second = full_string[start + i + 1];
+    uint32_t pair = (script == HB_SCRIPT_LATIN) << 16 | first << 8 | second;
+    auto cached = font_pairs->second.find(pair);
+    hb_position_t kerning = 0;
+    if (cached != font_pairs->second.end()) {
+      kerning = cached->second;
+    } else {
+      if (!pair_kerning(font, script, first, second, kerning)) {
+        kerning = INT32_MIN;
+      }
+      font_pairs->second[pair] = kerning;
+    }
+    if (kerning == INT32_MIN) {
+      return false;
+    }
+    simple_pos[i].x_advance += kerning;
+  }
+  return true;
+}
+
+bool HarfBuzzShaper::pair_kerning(hb_font_t* font, hb_script_t script, uint32_t first,
+                                  uint32_t second, hb_position_t& kerning) {
+  // The kerning of a pair is the change HarfBuzz makes to the advance of the
+  // first glyph when shaping the pair alone, in the script of the full text.
+  // Fails if shaping the pair does anything else
+  uint32_t pair[2] = {first, second};
+  hb_buffer_reset(buffer);
+  hb_buffer_add_utf32(buffer, pair, 2, 0, 2);
+  hb_buffer_set_script(buffer, script);
+  hb_buffer_guess_segment_properties(buffer);
+  hb_buffer_set_direction(buffer, HB_DIRECTION_LTR);
+  hb_shape(font, buffer, NULL, 0);
+
+  unsigned int n_glyphs = 0;
+  hb_glyph_info_t* info = hb_buffer_get_glyph_infos(buffer, &n_glyphs);
+  hb_glyph_position_t* pos = hb_buffer_get_glyph_positions(buffer, &n_glyphs);
+  hb_codepoint_t first_glyph = 0;
+  hb_codepoint_t second_glyph = 0;
+  if (n_glyphs != 2 ||
+      !hb_font_get_nominal_glyph(font, first, &first_glyph) ||
+      !hb_font_get_nominal_glyph(font, second, &second_glyph) ||
+      info[0].codepoint != first_glyph || info[1].codepoint != second_glyph) {
+    return false;
+  }
+  if (pos[0].x_offset != 0 || pos[0].y_offset != 0 || pos[0].y_advance != 0 ||
+      pos[1].x_offset != 0 || pos[1].y_offset != 0 || pos[1].y_advance != 0 ||
+      pos[1].x_advance != hb_font_get_glyph_h_advance(font, second_glyph)) {
+    return false;
+  }
+  kerning = pos[0].x_advance - hb_font_get_glyph_h_advance(font, first_glyph);
+  return true;
+}
+
+bool HarfBuzzShaper::shape_monospace(unsigned int start, unsigned int end, hb_font_t* font, const SimpleFont& simple_font) {
+  // Printable ASCII in a monospaced font. Glyphs come from the table made when
+  // the font was inspected and all share the advance of the space. Coding fonts
+  // substitute some ASCII sequences, so this gives up on text with characters
+  // touched by any lookup, kerning included
+  unsigned int n_chars = end - start;
+  for (unsigned int i = 0; i < n_chars; ++i) {
+    uint32_t c = full_string[start + i];
+    if (c < 0x20 || c > 0x7E || simple_font.chars[c] != SIMPLE_CHAR) {
+      return false;
+    }
+  }
+  hb_position_t advance = hb_font_get_glyph_h_advance(font, simple_font.ascii_glyphs[0]);
+  simple_info.resize(n_chars);
+  simple_pos.resize(n_chars);
+  for (unsigned int i = 0; i < n_chars; ++i) {
+    simple_info[i] = hb_glyph_info_t();
+    simple_info[i].codepoint = simple_font.ascii_glyphs[full_string[start + i] - 0x20];
+    simple_info[i].cluster = start + i;
+    simple_pos[i] = hb_glyph_position_t();
+    simple_pos[i].x_advance = advance;
+  }
+  return true;
+}
+
 // Add shaping info to the embedding structure
 void HarfBuzzShaper::fill_shape_info(hb_glyph_info_t* glyph_info,
                                      hb_glyph_position_t* glyph_pos,
@@ -1013,7 +1939,11 @@ void HarfBuzzShaper::fill_shape_info(hb_glyph_info_t* glyph_info,
     embedding.y_advance.push_back(glyph_pos[i].y_advance * scaling);
     embedding.full_width += embedding.x_advance.back();
 
-    hb_font_get_glyph_extents(font, glyph_info[i].codepoint, &extent);
+    if (width_only) {
+      extent = {0, 0, 0, 0};
+    } else {
+      hb_font_get_glyph_extents(font, glyph_info[i].codepoint, &extent);
+    }
     embedding.x_bear.push_back(extent.x_bearing * scaling);
     embedding.y_bear.push_back(extent.y_bearing * scaling);
     embedding.width.push_back(extent.width * scaling);
@@ -1028,6 +1958,8 @@ void HarfBuzzShaper::fill_shape_info(hb_glyph_info_t* glyph_info,
 
 // Add line breaking/stretching info to embedding structure
 void HarfBuzzShaper::fill_glyph_info(EmbedInfo& embedding) {
+  // Only needed for line breaking and justification
+  if (width_only) return;
   for (size_t i = embedding.is_blank.size(); i < embedding.glyph_cluster.size(); ++i) {
     int32_t cluster = embedding.glyph_cluster[i];
     if (cluster < full_string.size()) {
@@ -1044,9 +1976,9 @@ void HarfBuzzShaper::fill_glyph_info(EmbedInfo& embedding) {
 
 inline FT_Face HarfBuzzShaper::get_font_sizing(FontSettings& font_info, double size, double res, std::vector<double>& sizes, std::vector<double>& scales, bool deref) {
   int error = 0;
-  FT_Face face = get_cached_or_new_face(font_info.file, font_info.index, size, res, &error);
+  FT_Face face = get_face(font_info.file, font_info.index, size, res, &error);
   if (error != 0) {
-    Rprintf("Failed to get face: %s, %i\n", font_info.file, font_info.index);
+    report_face_error(font_info);
     error_code = error;
     return nullptr;
   }
@@ -1058,11 +1990,11 @@ inline FT_Face HarfBuzzShaper::get_font_sizing(FontSettings& font_info, double s
   return face;
 }
 
-void HarfBuzzShaper::insert_hyphen(EmbedInfo& embedding, size_t where) {
+hb_font_t* HarfBuzzShaper::get_hyphen(const EmbedInfo& embedding, size_t where, hb_codepoint_t& glyph, double& scaling) {
   int error = 0;
   // Load main font (emoji if dir is negative)
   // Shouldn't be able to fail as we have already tried to load it in the calling function
-  FT_Face face = get_cached_or_new_face(
+  FT_Face face = get_face(
     embedding.fallbacks[embedding.font[where]].file,
     embedding.fallbacks[embedding.font[where]].index,
     embedding.fallback_size[embedding.font[where]],
@@ -1070,21 +2002,43 @@ void HarfBuzzShaper::insert_hyphen(EmbedInfo& embedding, size_t where) {
     &error
   );
   if (error) {
-    return;
+    return nullptr;
   }
 
-  double scaling = embedding.fallback_scaling[embedding.font[where]];
+  scaling = embedding.fallback_scaling[embedding.font[where]];
   if (scaling < 0) scaling = 1.0;
 
   hb_font_t *font = hb_ft_font_create_referenced(face);
   FT_Done_Face(face);
-  hb_codepoint_t glyph = 0;
+  glyph = 0;
   hb_bool_t found = hb_font_get_glyph(font, 8208, 0, &glyph); // True hyphen;
   if (!found) found = hb_font_get_glyph(font, 45, 0, &glyph); // Hyphen minus
 
-  if (!found) return; // No hyphen-like glyph in font
+  if (!found) { // No hyphen-like glyph in font
+    hb_font_destroy(font);
+    return nullptr;
+  }
+  return font;
+}
+
+int32_t HarfBuzzShaper::hyphen_advance(const EmbedInfo& embedding, size_t where) {
+  hb_codepoint_t glyph;
+  double scaling;
+  hb_font_t* font = get_hyphen(embedding, where, glyph, scaling);
+  if (font == nullptr) return embedding.x_advance[where];
+  int32_t advance = hb_font_get_glyph_h_advance(font, glyph) * scaling;
+  hb_font_destroy(font);
+  return advance;
+}
+
+void HarfBuzzShaper::insert_hyphen(EmbedInfo& embedding, size_t where) {
+  hb_codepoint_t glyph;
+  double scaling;
+  hb_font_t* font = get_hyphen(embedding, where, glyph, scaling);
+  if (font == nullptr) return;
 
   embedding.glyph_id[where] = glyph;
+  embedding.clear_break_index();
 
   hb_position_t x = hb_font_get_glyph_h_advance(font, glyph);
   hb_position_t y = 0;
@@ -1108,7 +2062,71 @@ void HarfBuzzShaper::insert_hyphen(EmbedInfo& embedding, size_t where) {
   hb_font_destroy(font);
 }
 
-bool HarfBuzzShaper::has_valid_break(const EmbedInfo& embedding, int32_t width, size_t& break_pos, bool force) {
+bool HarfBuzzShaper::has_valid_break(EmbedInfo& embedding, int32_t width, size_t& break_pos, bool force) {
+  // Glyphs are consumed from the start of the line (the front if ltr and the
+  // back if rtl). A line may end at a glyph if all glyphs up to it fit. If the
+  // glyph is blank we don't care if it extends beyond the max width. The
+  // running sums are monotone in that order so the last fitting break and the
+  // first overflowing glyph can be found with binary searches. Otherwise we
+  // fall back to summing the advances glyph by glyph
+  embedding.index_breaks();
+  if (!embedding.monotone_advance) {
+    return has_valid_break_linear(embedding, width, break_pos, force);
+  }
+  const std::vector<int64_t>& cum = embedding.cum_advance;
+  const std::vector<size_t>& breaks = embedding.break_glyphs;
+  size_t offset = embedding.n_split_front;
+  size_t n = embedding.glyph_id.size();
+  if (n == 0) return false;
+  if (embedding.embedding_level % 2 == 0) { // ltr
+    int64_t limit = cum[0] + width;
+    // The last break whose glyphs fit
+    auto after = std::upper_bound(breaks.begin(), breaks.end(), limit, [&](int64_t lim, size_t b) {
+      size_t i = b - offset;
+      return lim < (embedding.is_blank[i] ? cum[i] : cum[i + 1]);
+    });
+    bool has_break = after != breaks.begin();
+    if (has_break) {
+      break_pos = *std::prev(after) - offset;
+    } else if (!breaks.empty() && breaks.front() == offset && embedding.is_blank[0]) {
+      // A leading blank is always accepted
+      break_pos = 0;
+      has_break = true;
+    }
+    if (force && cum[n] > limit) {
+      // If forcing we need to consume at least one glyph
+      size_t overflow = std::upper_bound(cum.begin() + 1, cum.end(), limit) - cum.begin() - 1;
+      break_pos = std::max(overflow - 1, size_t(1));
+      return true;
+    }
+    if (!has_break) break_pos = 0;
+    return has_break;
+  } else {
+    int64_t limit = cum[n] - width;
+    // The first break (i.e. the last in logical order) whose glyphs fit
+    auto first = std::lower_bound(breaks.begin(), breaks.end(), limit, [&](size_t b, int64_t lim) {
+      size_t i = b - offset;
+      return (embedding.is_blank[i] ? cum[i + 1] : cum[i]) < lim;
+    });
+    bool has_break = first != breaks.end();
+    if (has_break) {
+      break_pos = *first - offset;
+    } else if (!breaks.empty() && breaks.back() == offset + n - 1 && embedding.is_blank[n - 1]) {
+      // A leading blank is always accepted
+      break_pos = n - 1;
+      has_break = true;
+    }
+    if (force && cum[0] < limit) {
+      // If forcing we need to consume at least one glyph
+      size_t overflow = std::lower_bound(cum.begin(), cum.begin() + n, limit) - cum.begin() - 1;
+      break_pos = std::min(overflow + 1, n - 2);
+      return true;
+    }
+    return has_break;
+  }
+}
+
+bool HarfBuzzShaper::has_valid_break_linear(const EmbedInfo& embedding, int32_t width, size_t& break_pos, bool force) {
   bool has_break = false;
   int32_t w = 0;
   if (embedding.embedding_level % 2 == 0) { // ltr
@@ -1161,7 +2179,6 @@ bool HarfBuzzShaper::has_valid_break(const EmbedInfo& embedding, int32_t width,
 }
 
 void HarfBuzzShaper::rearrange_embeddings(std::list<EmbedInfo>& line) {
-  static std::vector<std::list<EmbedInfo>::iterator> embed_stack(125); // Max nesting level allowed by ICU bidi algo
 
   if (line.size() < 2) return; // Nothing to do
 
@@ -1265,7 +2282,7 @@ std::list<EmbedInfo> HarfBuzzShaper::get_next_line_at_width(int32_t width, std::
       }
       if (line.empty()) {
         // If we end here we completely failed to fit a single glyph to the line
-        cpp11::stop("Failed to wrap lines");
+        throw std::runtime_error("Failed to wrap lines");
       }
     } else if (iter == all_embeddings.end()) {
       hard_break = all_embeddings.back().terminates_paragraph;
@@ -1281,42 +2298,77 @@ std::list<EmbedInfo> HarfBuzzShaper::get_next_line_at_width(int32_t width, std::
   return line;
 }
 
+std::list<EmbedInfo> HarfBuzzShaper::get_next_line_at_glyph(size_t n_glyphs, std::list<EmbedInfo>& all_embeddings) {
+  std::list<EmbedInfo> line;
+  auto iter = all_embeddings.begin();
+  while (iter != all_embeddings.end() && n_glyphs > iter->glyph_id.size()) {
+    n_glyphs -= iter->glyph_id.size();
+    ++iter;
+  }
+  if (iter == all_embeddings.end()) {
+    line.swap(all_embeddings);
+  } else {
+    // Split the embedding holding the last glyph of the line
+    size_t n = iter->glyph_id.size();
+    bool ltr = iter->embedding_level % 2 == 0;
+    size_t break_at = ltr ? n_glyphs - 1 : n - n_glyphs;
+    bool is_shy = n_glyphs > 0 && full_string[iter->glyph_cluster[break_at]] == 173;
+    line.splice(line.begin(), all_embeddings, all_embeddings.begin(), iter);
+    line.emplace_back();
+    if (ltr) {
+      iter->split(0, n_glyphs, line.back());
+    } else {
+      iter->split(n - n_glyphs, n, line.back());
+    }
+    if (is_shy) { // Substitute soft hyphen with hyphen
+      insert_hyphen(line.back(), ltr ? line.back().glyph_id.size() - 1 : 0);
+    }
+  }
+  rearrange_embeddings(line);
+  return line;
+}
+
 void HarfBuzzShaper::do_alignment(bool ltr) {
+  // All adjustments are derived from the per-line stats collected in
+  // finish_string() so the pen and line widths are correct even if no glyph
+  // positions have been recorded
+  size_t n_lines = line_width.size();
+  int last_glyph_line = -1;
+  for (size_t i = 0; i < n_lines; ++i) {
+    if (line_n_glyphs[i] != 0) last_glyph_line = i;
+  }
   if (cur_align == 1 || cur_align == 2) {
     // Standard center or right justify
     // Move x_pos based on the linewidth of the line and the full width of the text
     for (size_t i = 0; i < x_pos.size(); ++i) {
       int index = line_id[i];
       int32_t lwd = line_width[index];
-      x_pos[i] = cur_align == 1 ? x_pos[i] + width/2 - lwd/2 : x_pos[i] + width - lwd;
+      int32_t target = line_target(index);
+      x_pos[i] = cur_align == 1 ? x_pos[i] + target/2 - lwd/2 : x_pos[i] + target - lwd;
     }
     // Do the same with pen position
-    pen_x = cur_align == 1 ? pen_x + width/2 - line_width.back()/2 : pen_x + width - line_width.back();
+    int32_t last_target = line_target(n_lines - 1);
+    pen_x = cur_align == 1 ? pen_x + last_target/2 - line_width.back()/2 : pen_x + last_target - line_width.back();
   }
   if (cur_align == 3 || cur_align == 4 || cur_align == 5) {
     // Justified alignment
-    std::vector<size_t> n_stretches(line_width.size(), 0);
-    std::vector<bool> no_stretch(line_width.size(), false);
-    for (size_t i = 0; i < x_pos.size(); ++i) {
-      // Loop through all glyphs to figure out number of stretches per line and if
-      // stretches are allowed (not for last line or lines with forced linebreak)
-      int index = line_id[i];
-      no_stretch[index] = no_stretch[index] || index == line_width.size() - 1 || line_must_break[index];
-      if (may_stretch[i] && i-1 < x_pos.size() && index == line_id[i+1]) {
-        n_stretches[index]++;
-      }
+    // Stretches are not allowed for last line or lines with forced linebreak
+    std::vector<bool> no_stretch(n_lines, false);
+    for (size_t i = 0; i < n_lines; ++i) {
+      no_stretch[i] = i == n_lines - 1 || line_must_break[i];
     }
     int32_t cum_move = 0;
     for (size_t i = 0; i < x_pos.size(); ++i) {
       // Loop through glyphs, spreading them out
       int index = line_id[i];
       int32_t lwd = line_width[index];
-      if (no_stretch[index] || n_stretches[index] == 0) {
+      int32_t target = line_target(index);
+      if (no_stretch[index] || line_n_stretch[index] == 0) {
         // If line may not stretch instead move it according to alignment
         if (cur_align == 4) {
-          x_pos[i] = x_pos[i] + width/2 - lwd/2;
+          x_pos[i] = x_pos[i] + target/2 - lwd/2;
         } else if (cur_align == 5) {
-          x_pos[i] = x_pos[i] + width - lwd;
+          x_pos[i] = x_pos[i] + target - lwd;
         }
         continue;
       }
@@ -1328,36 +2380,45 @@ void HarfBuzzShaper::do_alignment(bool ltr) {
       x_pos[i] += cum_move;
       if (may_stretch[i]) {
         // If white space the counter gets increased
-        cum_move += (width - line_width[index]) / n_stretches[index];
+        cum_move += (target - line_width[index]) / line_n_stretch[index];
       }
     }
     // Update pen_x to match position of last line
     if (ltr) {
+      // The pen has been moved by all stretches of the last stretched line
+      cum_move = 0;
+      for (size_t i = 0; i < n_lines; ++i) {
+        if (!no_stretch[i] && line_n_stretch[i] != 0) {
+          cum_move = line_n_may_stretch[i] * ((line_target(i) - line_width[i]) / line_n_stretch[i]);
+        }
+      }
       // If last line is empty ignore cum_move
-      pen_x += line_id.back() == line_width.size() - 1 ? cum_move : 0;
+      pen_x += last_glyph_line == int(n_lines - 1) ? cum_move : 0;
     }
-    if (no_stretch.back() || n_stretches.back() == 0) {
-      if (cur_align == 4) {
-        pen_x += width/2 - line_width.back()/2;
-      } else if (cur_align == 5) {
-        pen_x += width - line_width.back();
-      }
+    // The last line never stretches so the pen follows the alignment
+    int32_t last_target = line_target(n_lines - 1);
+    if (cur_align == 4) {
+      pen_x += last_target/2 - line_width.back()/2;
+    } else if (cur_align == 5) {
+      pen_x += last_target - line_width.back();
     }
     // Update line width of all stretched lines to match the full width of the textbox
-    for (size_t i = 0; i < line_width.size(); ++i) {
-      if (!no_stretch[i] && n_stretches[i] != 0) line_width[i] = width;
+    for (size_t i = 0; i < n_lines; ++i) {
+      if (!no_stretch[i] && line_n_stretch[i] != 0) line_width[i] = line_target(i);
     }
   }
   if (cur_align == 6) {
-    // Distribute glyphs evenly over line
-    std::vector<size_t> n_glyphs(line_width.size(), 0);
-    for (size_t i = 0; i < x_pos.size(); ++i) {
-      // Count number of glyphs on each line (not including carriage return)
-      int index = line_id[i];
-      if (!line_must_break[index] && (i == x_pos.size()-1 || index == line_id[i+1])) {
-        n_glyphs[index]++;
-      }
+    // Distribute glyphs evenly over line. Count the number of gaps on each line
+    // (the glyph ending the last line counts as it carries the pen)
+    std::vector<size_t> n_glyphs(n_lines, 0);
+    for (size_t i = 0; i < n_lines; ++i) {
+      if (line_n_glyphs[i] == 0 || line_must_break[i]) continue;
+      n_glyphs[i] = int(i) == last_glyph_line ? line_n_glyphs[i] : line_n_glyphs[i] - 1;
     }
+    auto spread = [&](size_t line) -> int32_t {
+      if (n_glyphs[line] < 2) return 0;
+      return (line_target(line) - line_width[line]) / (n_glyphs[line] - 1);
+    };
     // Spread out glyphs according to an accumulating spread factor
     int32_t cum_move = 0;
     for (size_t i = 0; i < x_pos.size(); ++i) {
@@ -1366,12 +2427,14 @@ void HarfBuzzShaper::do_alignment(bool ltr) {
         cum_move = 0;
       }
       x_pos[i] += cum_move;
-      cum_move += (width - line_width[index]) / (n_glyphs[index]-1);
+      cum_move += spread(index);
+    }
+    if (last_glyph_line >= 0) {
+      pen_x += line_n_glyphs[last_glyph_line] * spread(last_glyph_line);
     }
-    pen_x += cum_move;
     // Update line width of all stretched lines to match the full width of the textbox
-    for (size_t i = 0; i < line_width.size(); ++i) {
-      if (n_glyphs[i] != 0) line_width[i] = width;
+    for (size_t i = 0; i < n_lines; ++i) {
+      if (n_glyphs[i] != 0) line_width[i] = line_target(i);
     }
   }
 }
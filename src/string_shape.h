@@ -13,11 +13,15 @@
 #include FT_FREETYPE_H
 #include FT_SIZES_H
 #include <vector>
-#include <set>
+#include <list>
 #include <cstdint>
+#include <array>
+#include <stdexcept>
+#include <unordered_map>
 #include <hb.h>
 #include "utils.h"
 #include "cache_lru.h"
+#include "line_break.h"
 
 static const uint32_t EMPTY_CHAR = 0xffffffff; // Largest possible value. Unlikely any font would use that
 static const uint32_t SPACER_CHAR = 0xffffffff - 1; // Second largest possible value. Also unlikely any font would use that
@@ -42,15 +46,17 @@ struct ShapeID {
   unsigned int index;
   double size;
   double tracking;
+  bool width_only;
 
-  inline ShapeID() : string_hash(0), embed_hash(0), font(""), index(0), size(0.0), tracking(0.0) {}
+  inline ShapeID() : string_hash(0), embed_hash(0), font(""), index(0), size(0.0), tracking(0.0), width_only(false) {}
   inline ShapeID(const ShapeID& shape) :
     string_hash(shape.string_hash),
     embed_hash(shape.embed_hash),
     font(shape.font),
     index(shape.index),
     size(shape.size),
-    tracking(shape.tracking) {}
+    tracking(shape.tracking),
+    width_only(shape.width_only) {}
 
   inline bool operator==(const ShapeID &other) const {
     return string_hash == other.string_hash &&
@@ -58,7 +64,8 @@ struct ShapeID {
            index == other.index &&
            size == other.size &&
            font == other.font &&
-           tracking == other.tracking;
+           tracking == other.tracking &&
+           width_only == other.width_only;
   }
 };
 
@@ -71,6 +78,58 @@ struct BidiID {
   }
 };
 
+struct FaceID {
+  std::string file;
+  unsigned int index;
+  double size;
+  double res;
+
+  inline bool operator==(const FaceID &other) const {
+    return index == other.index &&
+           size == other.size &&
+           res == other.res &&
+           file == other.file;
+  }
+};
+
+struct GlyphMetricID {
+  std::string file;
+  unsigned int index;
+  double size;
+  double res;
+  uint32_t codepoint;
+  size_t features;
+
+  inline bool operator==(const GlyphMetricID &other) const {
+    return codepoint == other.codepoint &&
+           features == other.features &&
+           index == other.index &&
+           size == other.size &&
+           res == other.res &&
+           file == other.file;
+  }
+};
+
+struct GlyphMetrics {
+  double ascent;
+  double descent;
+  double width;
+};
+
+// Flags for the characters of SimpleFont::chars
+static const uint8_t SIMPLE_CHAR = 1; // Untouched by substitutions and positioning other than kerning
+static const uint8_t SIMPLE_KERN = 2; // May be kerned against the character following it
+
+// What we know about a font for shaping it without HarfBuzz
+struct SimpleFont {
+  bool simple;
+  // Whether all printable ASCII characters have a glyph of the same width
+  bool monospace;
+  std::array<hb_codepoint_t, 95> ascii_glyphs;
+  // Flags for the characters up to U+00FF
+  std::array<uint8_t, 256> chars;
+};
+
 struct EmbedInfo {
   std::vector<size_t> glyph_id;
   std::vector<size_t> glyph_cluster;
@@ -95,12 +154,37 @@ struct EmbedInfo {
   size_t embedding_level;
   int32_t full_width;
   bool terminates_paragraph;
+  // Running sum of x_advance starting from the width of glyphs already split
+  // off the front, and the glyphs that may break (counted from the original
+  // front). Built by index_breaks() and kept up to date by split() so breaks
+  // can be found by width with a binary search. The search requires the sums
+  // to be monotone, which negative advances (e.g. from negative tracking) break
+  std::vector<int64_t> cum_advance;
+  std::vector<size_t> break_glyphs;
+  size_t n_split_front;
+  bool monotone_advance;
+  void index_breaks() {
+    if (cum_advance.size() == x_advance.size() + 1) return;
+    cum_advance.assign(1, 0);
+    break_glyphs.clear();
+    n_split_front = 0;
+    monotone_advance = true;
+    for (size_t i = 0; i < x_advance.size(); ++i) {
+      cum_advance.push_back(cum_advance.back() + x_advance[i]);
+      if (x_advance[i] < 0) monotone_advance = false;
+      if (may_break[i]) break_glyphs.push_back(i);
+    }
+  }
+  void clear_break_index() {
+    cum_advance.clear();
+    break_glyphs.clear();
+  }
   void add(const EmbedInfo& other, bool check = true) {
     if (check && embedding_level != other.embedding_level) {
-      cpp11::stop("Unable to merge embeddings of different levels");
+      throw std::runtime_error("Unable to merge embeddings of different levels");
     }
     if (check && terminates_paragraph) {
-      cpp11::stop("Can't combine embeddings past termination point");
+      throw std::runtime_error("Can't combine embeddings past termination point");
     }
     glyph_id.insert(glyph_id.end(), other.glyph_id.begin(), other.glyph_id.end());
     glyph_cluster.insert(glyph_cluster.end(), other.glyph_cluster.begin(), other.glyph_cluster.end());
@@ -126,11 +210,29 @@ struct EmbedInfo {
     fallback_scaling.insert(fallback_scaling.end(), other.fallback_scaling.begin(), other.fallback_scaling.end());
     full_width += other.full_width;
     terminates_paragraph = other.terminates_paragraph;
+    clear_break_index();
   }
   void split(size_t from, size_t to, EmbedInfo& into) {
     into.embedding_level = embedding_level;
     into.terminates_paragraph = false;
 
+    if (cum_advance.size() == x_advance.size() + 1 && (from == 0 || to == x_advance.size())) {
+      // Glyphs are only split off the ends when breaking lines, which leaves
+      // the running sums of the remaining glyphs valid
+      if (from == 0) {
+        cum_advance.erase(cum_advance.begin(), cum_advance.begin() + to);
+        n_split_front += to;
+        auto first = std::lower_bound(break_glyphs.begin(), break_glyphs.end(), n_split_front);
+        break_glyphs.erase(break_glyphs.begin(), first);
+      } else {
+        cum_advance.resize(from + 1);
+        auto last = std::lower_bound(break_glyphs.begin(), break_glyphs.end(), n_split_front + from);
+        break_glyphs.erase(last, break_glyphs.end());
+      }
+    } else {
+      clear_break_index();
+    }
+
     into.glyph_id.insert(into.glyph_id.end(), glyph_id.begin() + from, glyph_id.begin() + to);
     glyph_id.erase(glyph_id.begin() + from, glyph_id.begin() + to);
     into.glyph_cluster.insert(into.glyph_cluster.end(), glyph_cluster.begin() + from, glyph_cluster.begin() + to);
@@ -171,6 +273,14 @@ struct EmbedInfo {
     into.full_width = std::accumulate(into.x_advance.begin(), into.x_advance.end(), int32_t(0));
     full_width -= into.full_width;
   }
+  // Move the clusters of all real glyphs, e.g. when the glyphs are moved to
+  // another position in the full string
+  void shift_clusters(int64_t offset) {
+    for (size_t i = 0; i < glyph_cluster.size(); ++i) {
+      if (glyph_id[i] == SPACER_CHAR || glyph_id[i] == EMPTY_CHAR) continue;
+      glyph_cluster[i] += offset;
+    }
+  }
   uint32_t pop() {
     uint32_t cluster;
     if (embedding_level % 2 == 0) {
@@ -213,9 +323,15 @@ struct EmbedInfo {
       may_stretch.erase(may_stretch.begin());
       font.erase(font.begin());
     }
+    clear_break_index();
     return cluster;
   }
 };
+struct LayoutLine {
+  std::list<EmbedInfo> embeddings;
+  bool hard_break;
+};
+
 struct ShapeInfo {
   size_t run_start;
   size_t run_end;
@@ -248,17 +364,57 @@ struct ShapeInfo {
   }
 };
 
+// The input of a paragraph along with the results of the stages that have been
+// run on it. Used to keep a batch of paragraphs in flight while processing them
+// in stages with a single shaper
+struct ParagraphState {
+  std::vector<uint32_t> full_string;
+  TextInfo text_info;
+  std::vector<int> bidi_embedding;
+  bool bidi_resolved = false;
+  std::vector<bool> soft_break;
+  std::vector<bool> hard_break;
+  std::vector<ShapeInfo> shape_infos;
+  double lineheight = 0.0;
+  int align = 0;
+  double hjust = 0.0;
+  double vjust = 0.0;
+  double res = 0.0;
+  int32_t max_width = 0;
+  int32_t indent = 0;
+  int32_t hanging = 0;
+  int32_t space_before = 0;
+  int32_t space_after = 0;
+  int dir = 0;
+};
+
+// A paragraph that has been shaped and had its runs put in visual order, kept
+// so it can be laid out repeatedly (e.g. at different widths) without being
+// shaped again
+struct ShapedParagraph {
+  ParagraphState state;
+  std::list<EmbedInfo> embeddings;
+};
+
+// Gives the same hash as TextInfo::hash() for the same codepoints
 template<typename Iterator>
 inline size_t vector_hash(Iterator begin, Iterator end) {
-  size_t answer = end - begin;
+  size_t answer = 0;
   for (auto iter = begin; iter != end; ++iter) {
-    uint32_t x = *iter;
-    x = ((x >> 16) ^ x) * 0x45d9f3b;
-    x = ((x >> 16) ^ x) * 0x45d9f3b;
-    x = (x >> 16) ^ x;
-    answer ^= x + 0x9e3779b9 + (answer << 6) + (answer >> 2);
+    answer = hash_codepoint(answer, *iter);
+  }
+  return hash_finish(answer, end - begin);
+}
+// Hash of the OpenType feature settings of a font, 0 if there are none
+inline size_t features_hash(const FontSettings& font_info) {
+  if (font_info.n_features == 0) return 0;
+  size_t answer = 0;
+  for (int i = 0; i < font_info.n_features; ++i) {
+    const unsigned char* tag = (const unsigned char*) font_info.features[i].feature;
+    answer = hash_codepoint(answer, uint32_t(tag[0]) << 24 | uint32_t(tag[1]) << 16 | uint32_t(tag[2]) << 8 | tag[3]);
+    answer = hash_codepoint(answer, font_info.features[i].setting);
   }
-  return answer;
+  return hash_finish(answer, font_info.n_features);
 }
 namespace std {
 template <>
@@ -269,7 +425,8 @@ struct hash<ShapeID> {
       std::hash<std::string>()(x.font) ^
       std::hash<unsigned int>()(x.index) ^
       std::hash<double>()(x.size) ^
-      std::hash<double>()(x.tracking);
+      std::hash<double>()(x.tracking) ^
+      std::hash<bool>()(x.width_only);
   }
 };
 
@@ -279,11 +436,36 @@ struct hash<BidiID> {
     return x.string_hash ^ std::hash<int>()(x.direction);
   }
 };
+
+template <>
+struct hash<FaceID> {
+  size_t operator()(const FaceID & x) const {
+    return std::hash<std::string>()(x.file) ^
+      std::hash<unsigned int>()(x.index) ^
+      std::hash<double>()(x.size) ^
+      std::hash<double>()(x.res);
+  }
+};
+
+template <>
+struct hash<GlyphMetricID> {
+  size_t operator()(const GlyphMetricID & x) const {
+    return std::hash<std::string>()(x.file) ^
+      std::hash<unsigned int>()(x.index) ^
+      std::hash<double>()(x.size) ^
+      std::hash<double>()(x.res) ^
+      std::hash<uint32_t>()(x.codepoint) ^
+      x.features;
+  }
+};
 }
 
 class HarfBuzzShaper {
 public:
-  HarfBuzzShaper() :
+  // A worker shaper can be used off the main thread. It loads fonts through its
+  // own FreeType library and keeps its own face cache since neither may be
+  // shared between threads
+  HarfBuzzShaper(bool worker = false) :
   // Public
   glyph_id(),
   glyph_cluster(),
@@ -311,7 +493,9 @@ public:
   dir(0),
   // Private
   full_string(),
+  text_info(),
   bidi_embedding(),
+  utf_converter(),
   soft_break(),
   hard_break(),
   cur_lineheight(0.0),
@@ -326,6 +510,9 @@ public:
   line_right_bear(),
   line_width(),
   line_id(),
+  line_n_glyphs(),
+  line_n_stretch(),
+  line_n_may_stretch(),
   top(0),
   bottom(0),
   ascend(0),
@@ -334,12 +521,21 @@ public:
   indent(0),
   hanging(0),
   space_before(0),
-  space_after(0)
+  space_after(0),
+  embed_stack(125), // Max nesting level allowed by ICU bidi algo
+  bidi_resolved(false),
+  width_only(false),
+  library(NULL),
+  face_cache(),
+  kern_pairs()
   {
     buffer = hb_buffer_create();
+    if (worker) FT_Init_FreeType(&library);
   };
   ~HarfBuzzShaper() {
     hb_buffer_destroy(buffer);
+    clear_face_cache();
+    if (library != NULL) FT_Done_FreeType(library);
   };
 
   std::vector<unsigned int> glyph_id;
@@ -372,25 +568,73 @@ public:
                     double size, double res, double lineheight,
                     int align, double hjust, double vjust, double width,
                     double tracking, double ind, double hang, double before,
-                    double after, bool spacer, int direction,
-                    std::vector<int>& soft_wrap, std::vector<int>& hard_wrap);
+                    double after, bool spacer, int direction);
   bool add_string(const char* string, FontSettings& font_info,
-                  double size, double tracking, bool spacer,
-                  std::vector<int>& soft_wrap, std::vector<int>& hard_wrap);
+                  double size, double tracking, bool spacer);
   bool add_spacer(FontSettings& font_info, double height, double width, uint32_t filler = SPACER_CHAR);
-  bool finish_string();
+  // If metrics_only is true the layout is computed but no glyph information is
+  // recorded, leaving only the overall metrics of the text. If n_threads is
+  // larger than 1 long texts are split at hard breaks and the parts are shaped
+  // and broken into lines on worker threads. Must be called on the main thread
+  // in that case
+  bool finish_string(bool metrics_only = false, size_t n_threads = 1);
+  // Whether finish_string() would split the current text over n_threads
+  bool can_split_string(size_t n_threads) const;
+
+  // The bidi and shaping stages of finish_string(). They can be run ahead of
+  // it, e.g. on all paragraphs in a batch, and are skipped by finish_string()
+  // if they have already been run on the current paragraph
+  void resolve_bidi(int& direction, bool segment = false);
+  void shape_runs(std::vector<ShapeInfo>& shapes, bool ltr);
+  void resolve_bidi() {
+    resolve_bidi(dir);
+  }
+  void shape_runs() {
+    shape_runs(shape_infos, dir != 2);
+  }
+  // Move the current paragraph into state, or make the paragraph held by state
+  // the current one
+  void store_paragraph(ParagraphState& state) {
+    swap_paragraph(state);
+  }
+  void load_paragraph(ParagraphState& state) {
+    reset();
+    swap_paragraph(state);
+  }
+
+  // Shape the current paragraph and move it into paragraph. It can then be laid
+  // out with layout_paragraph() as many times as needed. The layout settings
+  // are given in the same units as for shape_string(). If box_width is given
+  // each line is broken at the width of its own box instead of width, and
+  // moved by the offset of the box. The last box is used for the remaining
+  // lines
+  void store_shaped_paragraph(ShapedParagraph& paragraph);
+  bool layout_paragraph(const ShapedParagraph& paragraph, double lineheight,
+                        int align, double hjust, double vjust, double width,
+                        double ind, double hang, double before, double after,
+                        bool metrics_only = false,
+                        const std::vector<int32_t>& box_width = {},
+                        const std::vector<int32_t>& box_offset = {});
 
   void shape_text_run(ShapeInfo &text_run, bool ltr);
   EmbedInfo shape_single_line(const char* string, FontSettings& font_info, double size, double res);
+  const std::list<EmbedInfo>& shape_single_line_runs(const char* string, FontSettings& font_info, double size, double res);
+  bool shape_single_line_width(const char* string, FontSettings& font_info, double size, double res, int32_t& width);
+  bool glyph_metrics(uint32_t codepoint, FontSettings& font_info, double size, double res, GlyphMetrics& metrics);
 
 private:
   std::vector<uint32_t> full_string;
+  TextInfo text_info;
   std::vector<int> bidi_embedding;
-  static UTF_UCS utf_converter;
-  static LRU_Cache<BidiID, std::vector<int> > bidi_cache;
-  static LRU_Cache<ShapeID, ShapeInfo> shape_cache;
-  std::set<int> soft_break;
-  std::set<int> hard_break;
+  UTF_UCS utf_converter;
+  static Concurrent_Cache<BidiID, std::vector<int> > bidi_cache;
+  static Concurrent_Cache<ShapeID, ShapeInfo> shape_cache;
+  static Concurrent_Cache<GlyphMetricID, GlyphMetrics> metric_cache;
+  static Concurrent_Cache<FaceID, SimpleFont> simple_font_cache;
+  std::vector<hb_glyph_info_t> simple_info;
+  std::vector<hb_glyph_position_t> simple_pos;
+  std::vector<bool> soft_break;
+  std::vector<bool> hard_break;
   hb_buffer_t *buffer;
   double cur_lineheight;
   int cur_align;
@@ -404,19 +648,44 @@ private:
   std::vector<int32_t> line_right_bear;
   std::vector<int32_t> line_width;
   std::vector<int32_t> line_id;
+  std::vector<size_t> line_n_glyphs;
+  std::vector<size_t> line_n_stretch;
+  std::vector<size_t> line_n_may_stretch;
 
   int32_t top;
   int32_t bottom;
   int32_t ascend;
   int32_t descend;
   int32_t max_width;
+  // The width and horizontal offset of the box of each line, if the lines
+  // don't share max_width
+  std::vector<int32_t> line_box_width;
+  std::vector<int32_t> line_box_offset;
   int32_t indent;
   int32_t hanging;
   int32_t space_before;
   int32_t space_after;
+  std::vector<std::list<EmbedInfo>::iterator> embed_stack;
+  std::list<EmbedInfo> line_runs;
+  bool bidi_resolved;
+  bool width_only;
+  FT_Library library;
+  std::unordered_map<FaceID, FT_Face> face_cache;
+  // Pair kerning of simple fonts per font and size, filled as pairs are met.
+  // Pairs are keyed by the two characters and whether the text is Latin
+  std::unordered_map<FaceID, std::unordered_map<uint32_t, hb_position_t> > kern_pairs;
 
   void reset();
-  std::list<EmbedInfo> combine_embeddings(std::vector<ShapeInfo>& shapes, int& direction);
+  void swap_paragraph(ParagraphState& state);
+  FT_Face get_face(const char* fontfile, int index, double size, double res, int* error);
+  void clear_face_cache();
+  void report_face_error(const FontSettings& font_info);
+  std::list<EmbedInfo> combine_embeddings(std::vector<ShapeInfo>& shapes, int& direction, bool segment = false);
+  void break_lines(std::list<EmbedInfo>& embeddings, std::vector<LayoutLine>& lines);
+  bool layout_lines(std::vector<LayoutLine>& lines, bool metrics_only);
+  bool break_lines_parallel(size_t n_threads, std::vector<LayoutLine>& lines);
+  void load_segment(const HarfBuzzShaper& parent, size_t start, size_t end,
+                    std::vector<ShapeInfo>& segment_infos);
   bool shape_embedding(unsigned int start, unsigned int end, std::vector<hb_feature_t>& features,
                        int dir, ShapeInfo& shape_info, std::vector<FontSettings>& fallbacks,
                        std::vector<double>& fallback_sizes, std::vector<double>& fallback_scales);
@@ -438,13 +707,36 @@ private:
                        std::vector<double>& fallback_sizes,
                        std::vector<double>& fallback_scales);
   void fill_glyph_info(EmbedInfo& embedding);
+  bool font_is_simple(const FontSettings& font_info, FT_Face face, hb_font_t* font, SimpleFont& simple_font);
+  bool shape_simple(unsigned int start, unsigned int end, hb_font_t* font, const SimpleFont& simple_font,
+                    const FontSettings& font_info, double size, double res);
+  bool pair_kerning(hb_font_t* font, hb_script_t script, uint32_t first, uint32_t second,
+                    hb_position_t& kerning);
+  bool shape_monospace(unsigned int start, unsigned int end, hb_font_t* font, const SimpleFont& simple_font);
   FT_Face get_font_sizing(FontSettings& font_info, double size, double res, std::vector<double>& sizes, std::vector<double>& scales, bool deref = false);
+  hb_font_t* get_hyphen(const EmbedInfo& embedding, size_t where, hb_codepoint_t& glyph, double& scaling);
+  int32_t hyphen_advance(const EmbedInfo& embedding, size_t where);
   void insert_hyphen(EmbedInfo& embedding, size_t where);
-  bool has_valid_break(const EmbedInfo& embedding, int32_t width, size_t& break_pos, bool force);
+  bool has_valid_break(EmbedInfo& embedding, int32_t width, size_t& break_pos, bool force);
+  bool has_valid_break_linear(const EmbedInfo& embedding, int32_t width, size_t& break_pos, bool force);
   void rearrange_embeddings(std::list<EmbedInfo>& line);
   std::list<EmbedInfo> get_next_line_at_width(int32_t width, std::list<EmbedInfo>& all_embeddings, bool& hard_break, uint32_t& break_char);
+  std::list<EmbedInfo> get_next_line_at_glyph(size_t n_glyphs, std::list<EmbedInfo>& all_embeddings);
+  bool break_paragraph_optimal(std::list<EmbedInfo>& embeddings, std::vector<LayoutLine>& lines);
   void do_alignment(bool ltr);
 
+  int32_t line_box(size_t line) const {
+    return line_box_width[std::min(line, line_box_width.size() - 1)];
+  }
+  int32_t line_offset(size_t line) const {
+    if (line_box_offset.empty()) return 0;
+    return line_box_offset[std::min(line, line_box_offset.size() - 1)];
+  }
+  // The width a line is aligned within
+  int32_t line_target(size_t line) const {
+    return line_box_width.empty() ? width : line_box(line);
+  }
+
   inline double family_scaling(const char* family) {
     if (strcmp("Apple Color Emoji", family) == 0) {
       return 1.3;
@@ -454,6 +746,12 @@ private:
     return 1;
   }
 
+  // Characters that HarfBuzz maps straight to a glyph in fonts without layout
+  // tables. Excludes controls and the soft hyphen which is a default ignorable
+  inline bool is_simple_latin(uint32_t c) const {
+    return (c >= 0x20 && c <= 0x7E) || (c >= 0xA0 && c <= 0xFF && c != 0xAD);
+  }
+
   inline bool glyph_is_linebreak(int32_t id) const {
     switch (id) {
     case 10: return true;    // Line feed
@@ -535,11 +833,11 @@ private:
   }
 
   inline bool glyph_may_soft_break(int index) const {
-    return soft_break.find(index) != soft_break.end();
+    return index >= 0 && size_t(index) < soft_break.size() && soft_break[index];
   }
 
   inline bool glyph_must_hard_break(int index) const {
-    return hard_break.find(index) != hard_break.end();
+    return index >= 0 && size_t(index) < hard_break.size() && hard_break[index];
   }
 };
 
@@ -0,0 +1,296 @@
+#include "thread_pool.h"
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+#include <cpp11/protect.hpp>
+
+struct MainThreadTask {
+  const std::function<void()>* fn;
+  bool done;
+  std::exception_ptr error;
+};
+
+namespace {
+
+std::thread::id main_thread_id;
+
+// The queue the current thread is attached to, if any
+thread_local MainThreadQueue* attached_queue = nullptr;
+
+// State shared between the main thread and the workers of the active
+// parallel_for() call
+std::mutex main_mutex;
+std::condition_variable main_cv;
+std::condition_variable worker_cv;
+std::deque<MainThreadTask*> main_tasks;
+bool dispatching = false;
+size_t n_running = 0;
+
+// A task queue per worker. The owner takes tasks from the front while thieves
+// take from the back so they interfere as little as possible
+class TaskQueue {
+public:
+  void push(size_t task) {
+    std::lock_guard<std::mutex> lock(mutex);
+    tasks.push_back(task);
+  }
+  bool pop(size_t& task) {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (tasks.empty()) return false;
+    task = tasks.front();
+    tasks.pop_front();
+    return true;
+  }
+  bool steal(size_t& task) {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (tasks.empty()) return false;
+    task = tasks.back();
+    tasks.pop_back();
+    return true;
+  }
+
+private:
+  std::mutex mutex;
+  std::deque<size_t> tasks;
+};
+
+struct WorkState {
+  std::vector<TaskQueue> queues;
+  const std::function<void(size_t, size_t)>& fn;
+  std::atomic<bool> failed;
+  std::mutex error_mutex;
+  std::exception_ptr error;
+
+  WorkState(size_t n_threads, const std::function<void(size_t, size_t)>& _fn) :
+    queues(n_threads),
+    fn(_fn),
+    failed(false),
+    error_mutex(),
+    error() {}
+
+  void fail(std::exception_ptr e) {
+    std::lock_guard<std::mutex> lock(error_mutex);
+    if (!error) error = e;
+    failed = true;
+  }
+};
+
+void run_worker(size_t worker, WorkState& state) {
+  size_t n_queues = state.queues.size();
+  size_t task;
+  try {
+    while (!state.failed) {
+      bool found = state.queues[worker].pop(task);
+      for (size_t i = 1; i < n_queues && !found; ++i) {
+        found = state.queues[(worker + i) % n_queues].steal(task);
+      }
+      // No tasks are added once the workers are running so if all queues are
+      // empty we are done
+      if (!found) break;
+      state.fn(task, worker);
+    }
+  } catch (...) {
+    state.fail(std::current_exception());
+  }
+  std::lock_guard<std::mutex> lock(main_mutex);
+  n_running--;
+  main_cv.notify_one();
+}
+
+// Run a task on the main thread, storing any error for the thread waiting on
+// it
+void run_task(MainThreadTask* task) {
+  try {
+    // Protect against R errors so they don't longjmp past the waiting thread
+    cpp11::unwind_protect([&] { (*task->fn)(); });
+  } catch (...) {
+    task->error = std::current_exception();
+  }
+}
+
+// Queue fn for the main thread and wait for it to be run. Returns false if the
+// main thread isn't serving a parallel_for() call and the thread isn't
+// attached to a queue
+bool pass_to_main_thread(const std::function<void()>& fn) {
+  MainThreadTask task = {&fn, false, nullptr};
+  if (attached_queue != nullptr) {
+    if (!attached_queue->push(&task)) {
+      throw std::runtime_error("The main thread is no longer serving requests");
+    }
+    if (task.error) std::rethrow_exception(task.error);
+    return true;
+  }
+  {
+    std::unique_lock<std::mutex> lock(main_mutex);
+    if (!dispatching) return false;
+    main_tasks.push_back(&task);
+    main_cv.notify_one();
+    worker_cv.wait(lock, [&task] { return task.done; });
+  }
+  if (task.error) std::rethrow_exception(task.error);
+  return true;
+}
+
+}
+
+void register_main_thread() {
+  main_thread_id = std::this_thread::get_id();
+}
+
+bool on_main_thread() {
+  return std::this_thread::get_id() == main_thread_id;
+}
+
+bool try_run_on_main_thread(const std::function<void()>& fn) {
+  if (on_main_thread()) {
+    fn();
+    return true;
+  }
+  return pass_to_main_thread(fn);
+}
+
+void run_on_main_thread(const std::function<void()>& fn) {
+  if (!try_run_on_main_thread(fn)) {
+    throw std::runtime_error("R can only be accessed from the main thread");
+  }
+}
+
+void run_serialised(const std::function<void()>& fn) {
+  if (on_main_thread()) {
+    cpp11::unwind_protect([&] { fn(); });
+  } else if (!pass_to_main_thread(fn)) {
+    throw std::runtime_error("systemfonts can only be called from the main thread");
+  }
+}
+
+size_t n_threads_for(int requested, size_t n_tasks) {
+  size_t n_threads = requested;
+  if (requested <= 0) {
+    n_threads = std::max(std::thread::hardware_concurrency(), 1u);
+  }
+  return std::max(std::min(n_threads, n_tasks), size_t(1));
+}
+
+void parallel_for(size_t n_tasks, size_t n_threads,
+                  const std::function<void(size_t, size_t)>& fn) {
+  if (n_tasks == 0) return;
+  if (!on_main_thread() || dispatching) {
+    throw std::runtime_error("Parallel work can only be started from the main thread");
+  }
+  n_threads = std::max(std::min(n_threads, n_tasks), size_t(1));
+
+  WorkState state(n_threads, fn);
+  for (size_t i = 0; i < n_tasks; ++i) {
+    state.queues[i * n_threads / n_tasks].push(i);
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(main_mutex);
+    dispatching = true;
+    n_running = n_threads;
+  }
+  std::vector<std::thread> threads;
+  threads.reserve(n_threads);
+  for (size_t i = 0; i < n_threads; ++i) {
+    try {
+      threads.emplace_back(run_worker, i, std::ref(state));
+    } catch (...) {
+      // Threads that could not be started don't count as running. Their tasks
+      // will be stolen by the running workers
+      std::lock_guard<std::mutex> lock(main_mutex);
+      n_running -= n_threads - i;
+      if (i == 0) state.fail(std::current_exception());
+      break;
+    }
+  }
+
+  // Serve the workers until they are all done
+  {
+    std::unique_lock<std::mutex> lock(main_mutex);
+    while (true) {
+      main_cv.wait(lock, [] { return !main_tasks.empty() || n_running == 0; });
+      while (!main_tasks.empty()) {
+        MainThreadTask* task = main_tasks.front();
+        main_tasks.pop_front();
+        lock.unlock();
+        run_task(task);
+        lock.lock();
+        task->done = true;
+        worker_cv.notify_all();
+      }
+      if (n_running == 0) break;
+    }
+    dispatching = false;
+  }
+
+  for (auto iter = threads.begin(); iter != threads.end(); ++iter) {
+    iter->join();
+  }
+
+  if (state.error) std::rethrow_exception(state.error);
+}
+
+MainThreadQueue::MainThreadQueue() :
+  mutex(),
+  main_cv(),
+  task_cv(),
+  tasks(),
+  closed(false) {}
+
+void MainThreadQueue::attach() {
+  attached_queue = this;
+}
+
+void MainThreadQueue::detach() {
+  attached_queue = nullptr;
+  std::lock_guard<std::mutex> lock(mutex);
+  main_cv.notify_all();
+}
+
+bool MainThreadQueue::push(MainThreadTask* task) {
+  std::unique_lock<std::mutex> lock(mutex);
+  if (closed) return false;
+  tasks.push_back(task);
+  main_cv.notify_all();
+  task_cv.wait(lock, [this, task] { return task->done || closed; });
+  return task->done;
+}
+
+void MainThreadQueue::serve() {
+  serve_until([] { return true; });
+}
+
+void MainThreadQueue::serve_until(const std::function<bool()>& done) {
+  if (!on_main_thread()) {
+    throw std::runtime_error("Requests can only be served on the main thread");
+  }
+  std::unique_lock<std::mutex> lock(mutex);
+  while (true) {
+    while (!tasks.empty()) {
+      MainThreadTask* task = tasks.front();
+      tasks.pop_front();
+      lock.unlock();
+      run_task(task);
+      lock.lock();
+      task->done = true;
+      task_cv.notify_all();
+    }
+    if (done()) break;
+    main_cv.wait(lock, [this, &done] { return !tasks.empty() || done(); });
+  }
+}
+
+void MainThreadQueue::close() {
+  std::lock_guard<std::mutex> lock(mutex);
+  closed = true;
+  tasks.clear();
+  task_cv.notify_all();
+}
@@ -0,0 +1,77 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <mutex>
+
+struct MainThreadTask;
+
+// Record the calling thread as the R main thread. Called during package
+// initialisation
+void register_main_thread();
+bool on_main_thread();
+
+// Run fn on the R main thread and wait for it to finish. Worker threads started
+// by parallel_for() must use this for anything that touches R or calls into
+// systemfonts. On the main thread fn is simply called. Errors raised by fn
+// (including R errors) are rethrown in the calling thread
+void run_on_main_thread(const std::function<void()>& fn);
+
+// As run_on_main_thread() but returns false instead of throwing if the main
+// thread can't be reached, i.e. if called from a thread not started by
+// parallel_for() or attached to a MainThreadQueue, or while no parallel_for() is
+// running
+bool try_run_on_main_thread(const std::function<void()>& fn);
+
+// Run a call into systemfonts. All calls textshaping makes into systemfonts go
+// through here so they are only ever made on the main thread, where they can't
+// run concurrently with R code calling systemfonts. Other threads pass fn to
+// the main thread as run_on_main_thread() does, and throw if it can't be
+// reached. R errors raised by fn are rethrown as C++ exceptions
+void run_serialised(const std::function<void()>& fn);
+
+// The number of threads to use for n_tasks tasks. A request of 0 or less will
+// use all available cores
+size_t n_threads_for(int requested, size_t n_tasks);
+
+// Call fn(task, worker) for every task in [0, n_tasks) using n_threads worker
+// threads. Tasks are initially split into contiguous blocks, one per worker,
+// and workers that run out of tasks steal from the others. The main thread
+// serves run_on_main_thread() requests while the workers run. Once all workers
+// have stopped the first error thrown by a task is rethrown
+void parallel_for(size_t n_tasks, size_t n_threads,
+                  const std::function<void(size_t, size_t)>& fn);
+
+// Main thread requests from threads running alongside R rather than inside
+// parallel_for(), e.g. those of a background job. While a thread is attached,
+// its run_on_main_thread() and run_serialised() calls are queued here and wait
+// until the main thread runs them with serve() or serve_until(). Once closed,
+// waiting and later requests throw instead
+class MainThreadQueue {
+public:
+  MainThreadQueue();
+
+  // Called by the thread itself
+  void attach();
+  void detach();
+
+  // Run the queued requests. Must be called on the main thread
+  void serve();
+  // Serve requests until done() returns true. done() is checked whenever a
+  // thread detaches
+  void serve_until(const std::function<bool()>& done);
+  void close();
+
+  // Queue a task and wait for it to be run. Returns false if the queue is
+  // closed before that
+  bool push(MainThreadTask* task);
+
+private:
+  std::mutex mutex;
+  std::condition_variable main_cv;
+  std::condition_variable task_cv;
+  std::deque<MainThreadTask*> tasks;
+  bool closed;
+};
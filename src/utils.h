@@ -1,9 +1,14 @@
 #pragma once
 
 #include <cstdint>
+#include <cstring>
 #include <vector>
 #include <string>
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 #define R_NO_REMAP
 
 #define END_CPP11_NO_RETURN                                \
@@ -41,65 +46,6 @@
  Modified 2019 by Thomas Lin Pedersen to work with const char*
  */
 
-static const uint32_t offsetsFromUTF8[6] = {
-  0x00000000UL, 0x00003080UL, 0x000E2080UL,
-  0x03C82080UL, 0xFA082080UL, 0x82082080UL
-};
-
-static const char trailingBytesForUTF8[256] = {
-  0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0, 0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
-  0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0, 0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
-  0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0, 0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
-  0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0, 0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
-  0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0, 0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
-  0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0, 0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
-  1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1, 1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,
-  2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2, 3,3,3,3,3,3,3,3,4,4,4,4,5,5,5,5
-};
-
-/* conversions without error checking
- only works for valid UTF-8, i.e. no 5- or 6-byte sequences
- srcsz = source size in bytes, or -1 if 0-terminated
- sz = dest size in # of wide characters
-
- returns # characters converted
- dest will always be L'\0'-terminated, even if there isn't enough room
- for all the characters.
- if sz = srcsz+1 (i.e. 4*srcsz+4 bytes), there will always be enough space.
- */
-static int u8_toucs(uint32_t *dest, int sz, const char *src, int srcsz) {
-  uint32_t ch;
-  const char *src_end = src + srcsz;
-  int nb;
-  int i=0;
-
-  while (i < sz-1) {
-    nb = trailingBytesForUTF8[(unsigned char)*src];
-    if (srcsz == -1) {
-      if (*src == 0)
-        goto done_toucs;
-    }
-    else {
-      if (src + nb >= src_end)
-        goto done_toucs;
-    }
-    ch = 0;
-    switch (nb) {
-    /* these fall through deliberately */
-    case 5: ch += (unsigned char)*src++; ch <<= 6;
-    case 4: ch += (unsigned char)*src++; ch <<= 6;
-    case 3: ch += (unsigned char)*src++; ch <<= 6;
-    case 2: ch += (unsigned char)*src++; ch <<= 6;
-    case 1: ch += (unsigned char)*src++; ch <<= 6;
-    case 0: ch += (unsigned char)*src++;
-    }
-    ch -= offsetsFromUTF8[nb];
-    dest[i++] = ch;
-  }
-  done_toucs:
-    dest[i] = 0;
-  return i;
-}
 /* srcsz = number of source characters, or -1 if 0-terminated
  sz = size of dest buffer in bytes
 
@@ -156,6 +102,121 @@ inline int u8_toutf8(char *dest, int sz, const uint32_t *src, int srcsz) {
  by Jeff Bezanson
  */
 
+// Incremental version of the hash used for cache keys. Codepoints are folded in
+// one at a time and the length is mixed in at the end
+inline size_t hash_codepoint(size_t answer, uint32_t x) {
+  x = ((x >> 16) ^ x) * 0x45d9f3b;
+  x = ((x >> 16) ^ x) * 0x45d9f3b;
+  x = (x >> 16) ^ x;
+  return answer ^ (x + 0x9e3779b9 + (answer << 6) + (answer >> 2));
+}
+inline size_t hash_finish(size_t answer, size_t length) {
+  return answer ^ (length + 0x9e3779b9 + (answer << 6) + (answer >> 2));
+}
+
+// Properties of decoded text collected while decoding so later stages don't
+// have to scan the codepoints again
+struct TextInfo {
+  size_t hash_state = 0;
+  size_t length = 0;
+  bool ascii = true;
+  // Any characters from Hebrew onwards, which includes all strong RTL
+  // characters and bidi controls
+  bool has_rtl = false;
+  // Any characters at or after the zero width joiner
+  bool may_have_emoji = false;
+
+  inline void add(uint32_t c) {
+    hash_state = hash_codepoint(hash_state, c);
+    length++;
+    ascii = ascii && c < 0x80;
+    has_rtl = has_rtl || c >= 0x0590;
+    may_have_emoji = may_have_emoji || c >= 8205;
+  }
+  inline size_t hash() const {
+    return hash_finish(hash_state, length);
+  }
+};
+
+template<typename Iterator>
+inline TextInfo scan_text(Iterator begin, Iterator end) {
+  TextInfo info;
+  for (auto iter = begin; iter != end; ++iter) {
+    info.add(*iter);
+  }
+  return info;
+}
+
+// Decode n_bytes of UTF-8 into dest, which must have room for n_bytes + 1
+// codepoints, and add the codepoints to info. Invalid or truncated sequences
+// are replaced by U+FFFD. Runs of ASCII are widened 16 bytes at a time where
+// SSE2 is available. Returns the number of codepoints written. dest is
+// 0-terminated
+inline size_t u8_decode(uint32_t* dest, const char* src, size_t n_bytes, TextInfo& info) {
+  const unsigned char* s = reinterpret_cast<const unsigned char*>(src);
+  size_t i = 0;
+  size_t n = 0;
+  while (i < n_bytes) {
+#if defined(__SSE2__)
+    const __m128i zero = _mm_setzero_si128();
+    while (i + 16 <= n_bytes) {
+      __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(s + i));
+      if (_mm_movemask_epi8(chunk) != 0) break;
+      __m128i lo = _mm_unpacklo_epi8(chunk, zero);
+      __m128i hi = _mm_unpackhi_epi8(chunk, zero);
+      _mm_storeu_si128(reinterpret_cast<__m128i*>(dest + n), _mm_unpacklo_epi16(lo, zero));
+      _mm_storeu_si128(reinterpret_cast<__m128i*>(dest + n + 4), _mm_unpackhi_epi16(lo, zero));
+      _mm_storeu_si128(reinterpret_cast<__m128i*>(dest + n + 8), _mm_unpacklo_epi16(hi, zero));
+      _mm_storeu_si128(reinterpret_cast<__m128i*>(dest + n + 12), _mm_unpackhi_epi16(hi, zero));
+      for (size_t k = 0; k < 16; ++k) {
+        info.hash_state = hash_codepoint(info.hash_state, dest[n + k]);
+      }
+      info.length += 16;
+      n += 16;
+      i += 16;
+    }
+    if (i >= n_bytes) break;
+#endif
+    unsigned char c = s[i];
+    uint32_t ch = c;
+    size_t nb = 0;
+    unsigned char lo = 0x80;
+    unsigned char hi = 0xBF;
+    if (c >= 0xC2 && c <= 0xDF) {
+      nb = 1;
+      ch = c & 0x1F;
+    } else if (c >= 0xE0 && c <= 0xEF) {
+      nb = 2;
+      ch = c & 0x0F;
+      if (c == 0xE0) lo = 0xA0; // Overlong
+      if (c == 0xED) hi = 0x9F; // Surrogates
+    } else if (c >= 0xF0 && c <= 0xF4) {
+      nb = 3;
+      ch = c & 0x07;
+      if (c == 0xF0) lo = 0x90; // Overlong
+      if (c == 0xF4) hi = 0x8F; // Beyond U+10FFFF
+    }
+    bool valid = c < 0x80 || (nb > 0 && i + nb < n_bytes);
+    for (size_t k = 1; k <= nb && valid; ++k) {
+      unsigned char b = s[i + k];
+      valid = b >= lo && b <= hi;
+      ch = (ch << 6) | (b & 0x3F);
+      lo = 0x80;
+      hi = 0xBF;
+    }
+    if (valid) {
+      i += nb + 1;
+    } else {
+      ch = 0xFFFD;
+      i += 1;
+    }
+    dest[n++] = ch;
+    info.add(ch);
+  }
+  dest[n] = 0;
+  return n;
+}
+
 class UTF_UCS {
   std::vector<uint32_t> buffer_ucs;
   std::vector<char> buffer_utf;
@@ -169,17 +230,22 @@ public:
   ~UTF_UCS() {
   }
   const uint32_t * convert_to_ucs(const char * string, int &n_conv) {
+    TextInfo info;
+    return convert_to_ucs(string, n_conv, info);
+  }
+  // As above but also adds the decoded characters to info
+  const uint32_t * convert_to_ucs(const char * string, int &n_conv, TextInfo& info) {
     if (string == NULL) {
       n_conv = 0;
       return buffer_ucs.data();
     }
-    int n_bytes = strlen(string) + 1;
-    unsigned int max_size = n_bytes * 4;
-    if (buffer_ucs.size() < max_size) {
-      buffer_ucs.resize(max_size);
+    // Every character takes up at least one byte
+    size_t n_bytes = strlen(string);
+    if (buffer_ucs.size() < n_bytes + 1) {
+      buffer_ucs.resize(n_bytes + 1);
     }
 
-    n_conv = u8_toucs(buffer_ucs.data(), max_size, string, -1);
+    n_conv = u8_decode(buffer_ucs.data(), string, n_bytes, info);
 
     return buffer_ucs.data();
   }
@@ -0,0 +1,106 @@
+#ifndef NO_HARFBUZZ_FRIBIDI
+
+#include "wrap_width.h"
+
+#include <algorithm>
+#include <climits>
+
+WrapWidthSolver::WrapWidthSolver(const std::list<EmbedInfo>& embeddings,
+                                 int32_t _indent, int32_t _hanging) :
+  cum_advance({0}),
+  break_next(),
+  break_fit(),
+  segment_glyph({0}),
+  segment_break({0}),
+  indent(_indent),
+  hanging(_hanging) {
+  bool last_blank = false;
+  for (auto iter = embeddings.begin(); iter != embeddings.end(); ++iter) {
+    size_t n = iter->glyph_id.size();
+    bool ltr = iter->embedding_level % 2 == 0;
+    // The character ending the paragraph is removed from the line
+    size_t n_used = iter->terminates_paragraph && n > 0 ? n - 1 : n;
+    for (size_t k = 0; k < n_used; ++k) {
+      size_t i = ltr ? k : n - 1 - k;
+      int64_t before = cum_advance.back();
+      cum_advance.push_back(before + iter->x_advance[i]);
+      last_blank = iter->is_blank[i];
+      if (iter->may_break[i]) {
+        break_next.push_back(cum_advance.size() - 1);
+        break_fit.push_back(last_blank ? before : cum_advance.back());
+      }
+    }
+    if (iter->terminates_paragraph) {
+      end_segment(last_blank);
+      last_blank = false;
+    }
+  }
+  // A hard break at the very end is followed by an empty line
+  end_segment(last_blank);
+}
+
+void WrapWidthSolver::end_segment(bool last_blank) {
+  size_t end = cum_advance.size() - 1;
+  // The end of a segment can always end a line
+  if (end != segment_glyph.back() && (break_next.empty() || break_next.back() != end)) {
+    break_next.push_back(end);
+    break_fit.push_back(last_blank ? cum_advance[end - 1] : cum_advance[end]);
+  }
+  segment_glyph.push_back(end);
+  segment_break.push_back(break_next.size());
+}
+
+size_t WrapWidthSolver::n_lines(int64_t width) const {
+  size_t lines = 0;
+  for (size_t seg = 0; seg + 1 < segment_glyph.size(); ++seg) {
+    size_t start = segment_glyph[seg];
+    size_t end = segment_glyph[seg + 1];
+    auto first = break_fit.begin() + segment_break[seg];
+    auto last = break_fit.begin() + segment_break[seg + 1];
+    if (start == end) {
+      lines++;
+      continue;
+    }
+    int64_t line_indent = indent;
+    while (start < end) {
+      // The last break opportunity whose line fits
+      auto fit = std::upper_bound(first, last, cum_advance[start] + width - line_indent);
+      if (fit == first) return SIZE_MAX;
+      start = break_next[fit - break_fit.begin() - 1];
+      first = fit;
+      line_indent = hanging;
+      lines++;
+    }
+  }
+  return lines;
+}
+
+int64_t WrapWidthSolver::natural_width() const {
+  int64_t width = 0;
+  for (size_t seg = 0; seg + 1 < segment_glyph.size(); ++seg) {
+    if (segment_glyph[seg] == segment_glyph[seg + 1]) continue;
+    int64_t seg_width = break_fit[segment_break[seg + 1] - 1] - cum_advance[segment_glyph[seg]];
+    width = std::max(width, seg_width + indent);
+  }
+  return width;
+}
+
+int64_t WrapWidthSolver::min_width(size_t n) const {
+  // The line count only goes down as the width grows so the smallest width
+  // giving at most n lines can be found by bisection
+  int64_t low = 0;
+  int64_t high = natural_width();
+  n = std::max(n, segment_glyph.size() - 1);
+  while (low < high) {
+    int64_t mid = low + (high - low) / 2;
+    size_t lines = n_lines(mid);
+    if (lines != SIZE_MAX && lines <= n) {
+      high = mid;
+    } else {
+      low = mid + 1;
+    }
+  }
+  return high;
+}
+
+#endif
@@ -0,0 +1,48 @@
+#pragma once
+
+#ifndef NO_HARFBUZZ_FRIBIDI
+
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <vector>
+
+#include "string_shape.h"
+
+// Answers questions about greedy wrapping of a shaped paragraph at any width
+// without breaking it into lines. The glyphs are reduced to their running
+// advance in logical order and the break opportunities between them, so each
+// line of a wrap is found with a single binary search. Widths are given in the
+// same units as the glyph advances
+class WrapWidthSolver {
+public:
+  WrapWidthSolver(const std::list<EmbedInfo>& embeddings, int32_t indent, int32_t hanging);
+
+  // The number of lines when wrapped at width, or SIZE_MAX if some unbreakable
+  // part of the text doesn't fit on a line
+  size_t n_lines(int64_t width) const;
+  // The smallest width at which the text wraps into at most n lines. The text
+  // always needs at least one line per hard line break and never less width
+  // than its widest unbreakable part
+  int64_t min_width(size_t n) const;
+  // The width needed to fit each paragraph of the text on a single line
+  int64_t natural_width() const;
+
+private:
+  std::vector<int64_t> cum_advance;
+  // For each break opportunity the glyph starting the next line and the
+  // running advance needed to fit the line ending at it. A blank glyph at the
+  // break is allowed to extend past the width
+  std::vector<size_t> break_next;
+  std::vector<int64_t> break_fit;
+  // The first glyph and break opportunity of each part of the text between
+  // hard line breaks, with a final entry marking the end
+  std::vector<size_t> segment_glyph;
+  std::vector<size_t> segment_break;
+  int32_t indent;
+  int32_t hanging;
+
+  void end_segment(bool last_blank);
+};
+
+#endif